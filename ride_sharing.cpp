@@ -1,14 +1,44 @@
 #include <iostream>
 #include <vector>
 #include <queue>
+#include <deque>
+#include <map>
 #include <unordered_map>
+#include <unordered_set>
 #include <string>
+#include <cstring>
+#include <cerrno>
+#include <fstream>
+#include <sstream>
 #include <cmath>
 #include <chrono>
 #include <iomanip>
 #include <algorithm>
 #include <memory>
+#include <tuple>
 #include <cstdlib>
+#include <cstdint>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <filesystem>
+#include <functional>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#endif
+#if defined(__linux__) && !defined(RIDESHARE_NO_IO_URING)
+#define RIDESHARE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
 
 using namespace std;
 // Geohash precision (1-12)
@@ -17,6 +47,161 @@ const int GEOHASH_PRECISION = 6;
 // Timeout for ride requests in seconds
 const int REQUEST_TIMEOUT = 300; // 5 minutes
 
+// Window in seconds during which a repeated idempotency key is treated as a retry
+const int IDEMPOTENCY_WINDOW = REQUEST_TIMEOUT;
+
+// Peak rate of keyed ride requests the idempotency filter is sized for, and
+// how far a key may probe
+const int IDEMPOTENCY_PEAK_REQUESTS_PER_SECOND = 100;
+const int IDEMPOTENCY_PROBE_LIMIT = 16;
+
+// Latency SLO for ride requests in microseconds
+const long long RIDE_REQUEST_SLO_US = 50000; // 50 ms
+
+// Latency SLO for location updates in microseconds; missing it only degrades
+const long long LOCATION_UPDATE_SLO_US = 5000; // 5 ms
+
+// Pending request depths at which admission control degrades and sheds work
+const int QUEUE_DEPTH_DEGRADED = 500;
+const int QUEUE_DEPTH_SHEDDING = 2000;
+
+// Latency samples kept per operation and how often admission state is re-evaluated
+const int LATENCY_WINDOW = 256;
+const int ADMISSION_EVAL_INTERVAL = 32;
+
+// Per-tick time budgets in microseconds for each class of dispatch work
+const long long TICK_BUDGET_MATCHING_US = 20000;
+const long long TICK_BUDGET_LOCATIONS_US = 10000;
+const long long TICK_BUDGET_EXPIRY_US = 2000;
+const long long TICK_BUDGET_MAINTENANCE_US = 2000;
+
+// Minimum seconds between sweeps for expired ride requests
+const int EXPIRY_SWEEP_INTERVAL = 1;
+
+// Number of spatial shards the location index is split into
+const int SHARD_COUNT = 4;
+
+// Geohash prefix length that requests are routed to shards by (32^2 prefixes)
+const int SHARD_PREFIX_LENGTH = 2;
+const int SHARD_PREFIX_COUNT = 32 * 32;
+
+// A shard is rebalanced when its load exceeds the mean by this factor
+const double SHARD_IMBALANCE_RATIO = 1.5;
+
+// Seconds between shard load checks
+const int SHARD_REBALANCE_INTERVAL = 5;
+
+// Buffered index writes per shard before they are merged into its trie, and
+// the longest they wait for a merge otherwise
+const int DELTA_BUFFER_CAPACITY = 256;
+const int DELTA_MERGE_INTERVAL_MS = 100;
+
+// Geohash precision of nearby-car tiles, most drivers kept per tile, and how
+// often changed tiles are re-serialized
+const int NEARBY_TILE_PRECISION = 6;
+const int NEARBY_TILE_CAP = 32;
+const int NEARBY_TILE_REBUILD_INTERVAL_MS = 1000;
+
+// How often a follower checks the engine's event log for new events
+const int FOLLOWER_POLL_INTERVAL_MS = 100;
+
+// Position samples buffered per tracked trip between network flushes
+const int TRIP_STREAM_CAPACITY = 8;
+
+// Events kept in memory for change-data-capture subscribers (power of two)
+const int CHANGE_STREAM_CAPACITY = 4096;
+
+// Driver slots in the shared-memory driver table and its default segment name
+const int SHARED_DRIVER_CAPACITY = 65536;
+const char *const SHARED_DRIVER_SEGMENT = "/ride_sharing_drivers";
+
+// Attempts a reader makes at a shared slot before giving up; a slot can stay
+// mid-write forever if the engine died while writing it
+const int SHARED_READ_RETRIES = 1000;
+
+// matchRideRequest calls slower than this are captured for diagnosis
+const long long SLOW_MATCH_THRESHOLD_US = 10000; // 10 ms
+
+// Slow matches kept, and candidate drivers recorded per slow match
+const int SLOW_MATCH_CAPACITY = 32;
+const int SLOW_MATCH_CANDIDATES = 64;
+
+// Registered write buffers for batched log I/O and the size of each
+const int LOG_BUFFER_COUNT = 8;
+const int LOG_BUFFER_SIZE = 64 * 1024;
+
+// Failed io_uring_enter calls tolerated while waiting for a batch before the
+// log gives up on the ring and writes with pwrite
+const int LOG_SUBMIT_RETRIES = 3;
+
+// Every Nth event appended to an event log gets an entry in its in-memory
+// sequence-to-offset index
+const int EVENT_LOG_INDEX_INTERVAL = 256;
+
+// Exported event segments rotate at this size, and every Nth record of a
+// segment gets an entry in its time index
+const long long EXPORT_SEGMENT_BYTES = 64LL * 1024 * 1024;
+const int EXPORT_INDEX_INTERVAL = 1024;
+
+// Events waiting for the export thread beyond this are dropped
+const int EXPORT_PENDING_CAPACITY = 65536;
+
+// Shadow matcher jobs waiting beyond this are dropped, and results kept
+const int SHADOW_QUEUE_CAPACITY = 1024;
+const int SHADOW_RESULT_CAPACITY = 256;
+
+// The default shadow policy prefers the longest-idle driver among those at
+// most this factor farther than the nearest one
+const double SHADOW_IDLE_DISTANCE_SLACK = 1.2;
+
+// Relative costs, in units of one driver checked by the linear scan, used to
+// choose between walking the trie and scanning the dense driver table
+const double INDEX_PROBE_COST = 200;     // one prefix query down the trie
+const double INDEX_CANDIDATE_COST = 8;   // one driver collected and looked up
+const double SCAN_DRIVER_COST = 1;       // one available driver checked by the scan
+
+// Geohash length of the widest cells the matcher searches, and of the cells
+// the hot driver table keeps counts for
+const int MATCH_CELL_PRECISION = 3;
+
+// Search budget for a match while admission control is degraded or shedding
+const long long MATCH_DEADLINE_US = 1000; // 1 ms
+
+// Drivers on a trip are considered for a new request when they will drop
+// off within this many seconds in a cell of this precision around the
+// pickup (or one of its neighbours)
+const long long PREDICTED_MAX_REMAINING_S = 600;
+const int PREDICTED_DROPOFF_PRECISION = 5;
+
+// Average driving speed used to turn remaining trip time into distance
+const double PICKUP_SPEED_KMH = 30.0;
+
+// Largest pickup distance a batched dispatch will pair a request with
+const double BATCH_MATCH_RADIUS_KM = 5.0;
+
+// Default localhost port for the Prometheus metrics endpoint
+const int METRICS_PORT = 9464;
+
+// A scrape client that sends or reads nothing for this long is dropped
+const int METRICS_CLIENT_TIMEOUT_MS = 1000;
+
+// Per-thread metric shards; threads beyond this share shards
+const int METRIC_SHARDS = 16;
+
+// Width of the idle-time buckets drivers are indexed under for fleet queries
+const long long IDLE_BUCKET_SECONDS = 300; // 5 minutes
+
+// Fleet query results listed in full before the rest are only counted
+const int FLEET_QUERY_LISTED = 50;
+
+// A driver ID set container switches from a sorted array to a bitmap above
+// this many IDs, the point where the bitmap becomes the smaller of the two
+const int DRIVER_SET_ARRAY_LIMIT = 4096;
+
+// Fraction of a shard's target weight a layout cut may move to land on a
+// first-character boundary, which keeps shards spatially compact
+const double SHARD_CUT_TOLERANCE = 0.1;
+
 // Structure to represent a location with latitude and longitude
 struct Location
 {
@@ -39,6 +224,21 @@ struct Location
     }
 };
 
+// Vehicle classes drivers can be filtered by
+enum VehicleClass
+{
+    VEHICLE_STANDARD,
+    VEHICLE_EV,
+    VEHICLE_XL,
+    VEHICLE_CLASS_COUNT
+};
+
+const char *vehicleClassName(int vehicleClass)
+{
+    static const char *names[] = {"standard", "EV", "XL"};
+    return names[vehicleClass];
+}
+
 // Driver class
 class Driver
 {
@@ -47,9 +247,10 @@ public:
     Location location;
     chrono::system_clock::time_point lastActive;
     bool available;
+    VehicleClass vehicleClass;
 
-    Driver(int id, double lat, double lng)
-        : id(id), location(lat, lng), available(true)
+    Driver(int id, double lat, double lng, VehicleClass vehicleClass = VEHICLE_STANDARD)
+        : id(id), location(lat, lng), available(true), vehicleClass(vehicleClass)
     {
         lastActive = chrono::system_clock::now();
     }
@@ -97,6 +298,7 @@ public:
     
     Location location;
     chrono::system_clock::time_point requestTime;
+    string idempotencyKey; // empty when the client sent none
 
     Passenger(int id, double lat, double lng)
         : id(id), location(lat, lng)
@@ -128,450 +330,5875 @@ public:
     }
 };
 
-// Trie node for geohash-based location storage
-class TrieNode
+// Time-windowed filter that remembers recent ride request idempotency keys.
+// Keys are kept as 64-bit fingerprints in a fixed open-addressed table, so a
+// lookup is O(1) and memory stays bounded however many keys arrive. The
+// table holds four times the keys a full window at the peak rate produces, so
+// live keys are not evicted below that rate.
+class RequestDeduplicator
 {
-public:
-    unordered_map<char, shared_ptr<TrieNode>> children;
-    vector<int> driverIds;
+private:
+    struct Slot
+    {
+        uint64_t fingerprint; // 0 marks an empty slot
+        int passengerId;
+        chrono::system_clock::time_point recordedAt;
+    };
 
-    void insertDriver(const string &geohash, int driverId, int index = 0)
+    vector<Slot> slots;
+    size_t mask;
+
+    static uint64_t fingerprintOf(const string &key)
     {
-        if (index == geohash.length())
+        // FNV-1a
+        uint64_t hash = 1469598103934665603ULL;
+        for (unsigned char c : key)
         {
-            // Add driver to this node
-            if (find(driverIds.begin(), driverIds.end(), driverId) == driverIds.end())
-            {
-                driverIds.push_back(driverId);
-            }
-            return;
+            hash ^= c;
+            hash *= 1099511628211ULL;
         }
+        return hash == 0 ? 1 : hash;
+    }
 
-        char currentChar = geohash[index];
-        if (children.find(currentChar) == children.end())
+    static bool isLive(const Slot &slot, chrono::system_clock::time_point now)
+    {
+        return slot.fingerprint != 0 &&
+               now - slot.recordedAt <= chrono::seconds(IDEMPOTENCY_WINDOW);
+    }
+
+public:
+    RequestDeduplicator(int requestsPerSecond = IDEMPOTENCY_PEAK_REQUESTS_PER_SECOND,
+                        int windowSeconds = IDEMPOTENCY_WINDOW)
+    {
+        size_t capacity = 1;
+        while (capacity < 4 * (size_t)requestsPerSecond * windowSeconds)
         {
-            children[currentChar] = make_shared<TrieNode>();
+            capacity <<= 1;
         }
-        children[currentChar]->insertDriver(geohash, driverId, index + 1);
+        slots.assign(capacity, Slot{0, 0, {}});
+        mask = capacity - 1;
     }
 
-    void removeDriver(const string &geohash, int driverId, int index = 0)
+    // Returns the passenger ID recorded for this key, or -1 if it is new
+    int find(const string &key) const
     {
-        if (index == geohash.length())
+        uint64_t fingerprint = fingerprintOf(key);
+        auto now = chrono::system_clock::now();
+
+        for (int i = 0; i < IDEMPOTENCY_PROBE_LIMIT; i++)
         {
-            // Remove driver from this node
-            auto it = find(driverIds.begin(), driverIds.end(), driverId);
-            if (it != driverIds.end())
+            const Slot &slot = slots[(fingerprint + i) & mask];
+            if (slot.fingerprint == fingerprint && isLive(slot, now))
             {
-                driverIds.erase(it);
+                return slot.passengerId;
             }
-            return;
         }
+        return -1;
+    }
 
-        char currentChar = geohash[index];
-        if (children.find(currentChar) != children.end())
+    void remember(const string &key, int passengerId)
+    {
+        uint64_t fingerprint = fingerprintOf(key);
+        auto now = chrono::system_clock::now();
+        Slot *target = nullptr;
+
+        for (int i = 0; i < IDEMPOTENCY_PROBE_LIMIT; i++)
         {
-            children[currentChar]->removeDriver(geohash, driverId, index + 1);
+            Slot &slot = slots[(fingerprint + i) & mask];
+            if (slot.fingerprint == fingerprint || !isLive(slot, now))
+            {
+                target = &slot;
+                break;
+            }
+            // Table is saturated here: evict the oldest key in the probe window
+            if (target == nullptr || slot.recordedAt < target->recordedAt)
+            {
+                target = &slot;
+            }
         }
+
+        *target = Slot{fingerprint, passengerId, now};
     }
 
-    vector<int> findDriversWithPrefix(const string &prefix, int index = 0)
+    // Drops a key once its request is matched or expired, so a later request
+    // with the same key is new rather than a retry
+    void forget(const string &key)
     {
-        if (index == prefix.length())
+        uint64_t fingerprint = fingerprintOf(key);
+        for (int i = 0; i < IDEMPOTENCY_PROBE_LIMIT; i++)
         {
-            // Collect all drivers in this subtree
-            vector<int> result = driverIds;
-            for (const auto &pair : children)
+            Slot &slot = slots[(fingerprint + i) & mask];
+            if (slot.fingerprint == fingerprint)
             {
-                vector<int> childDrivers = pair.second->getAllDrivers();
-                result.insert(result.end(), childDrivers.begin(), childDrivers.end());
+                slot.fingerprint = 0;
             }
-            return result;
         }
+    }
+};
 
-        char currentChar = prefix[index];
-        if (children.find(currentChar) != children.end())
+// Sliding window of recent latency samples in microseconds
+class LatencyWindow
+{
+private:
+    vector<long long> samples;
+    int next;
+
+public:
+    LatencyWindow() : next(0) {}
+
+    void record(long long micros)
+    {
+        if (samples.size() < LATENCY_WINDOW)
         {
-            return children[currentChar]->findDriversWithPrefix(prefix, index + 1);
+            samples.push_back(micros);
         }
-
-        return {};
+        else
+        {
+            samples[next] = micros;
+        }
+        next = (next + 1) % LATENCY_WINDOW;
     }
 
-    vector<int> getAllDrivers() const
+    long long percentile(double p) const
     {
-        vector<int> result = driverIds;
-        for (const auto &pair : children)
+        if (samples.empty())
         {
-            vector<int> childDrivers = pair.second->getAllDrivers();
-            result.insert(result.end(), childDrivers.begin(), childDrivers.end());
+            return 0;
         }
-        return result;
+        vector<long long> sorted = samples;
+        size_t rank = min(sorted.size() - 1, (size_t)(p * sorted.size()));
+        nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+        return sorted[rank];
     }
 };
 
-// Geohash implementation
-class Geohash
+// Watches queue depth and request and location-update latency, and decides
+// which low-priority work to shed so ride requests stay within their SLO.
+class AdmissionController
 {
+public:
+    enum State
+    {
+        NORMAL,   // everything admitted
+        DEGRADED, // location pings coalesced
+        SHEDDING  // pings coalesced and stats calls rejected
+    };
+
 private:
-    static const string BASE32;
+    State state;
+    LatencyWindow rideRequestLatency;
+    LatencyWindow locationUpdateLatency;
+    size_t queueDepth;
+    int samplesSinceEval;
+    long long shedStatsCalls;
+    long long coalescedPings;
 
-    static pair<double, double> decodeRange(char c, int bit, double min, double max)
+    void maybeEvaluate()
     {
-        int index = BASE32.find(c);
-        if (index == string::npos)
-            return {min, max};
+        if (++samplesSinceEval < ADMISSION_EVAL_INTERVAL)
+        {
+            return;
+        }
+        samplesSinceEval = 0;
 
-        double mid = (min + max) / 2;
-        if ((index & (1 << (4 - bit))) != 0)
+        long long p99 = rideRequestLatency.percentile(0.99);
+        long long locationP99 = locationUpdateLatency.percentile(0.99);
+        if (queueDepth >= QUEUE_DEPTH_SHEDDING || p99 > RIDE_REQUEST_SLO_US)
         {
-            return {mid, max};
+            state = SHEDDING;
+        }
+        else if (queueDepth >= QUEUE_DEPTH_DEGRADED || p99 > RIDE_REQUEST_SLO_US / 2 ||
+                 locationP99 > LOCATION_UPDATE_SLO_US)
+        {
+            state = DEGRADED;
         }
         else
         {
-            return {min, mid};
+            state = NORMAL;
         }
     }
 
 public:
-    static string encode(double latitude, double longitude, int precision = GEOHASH_PRECISION)
-    {
-        double latMin = -90.0, latMax = 90.0;
-        double lonMin = -180.0, lonMax = 180.0;
-        string geohash;
-        int bit = 0;
-        int ch = 0;
-
-        for (int i = 0; i < precision; i++)
-        {
-            for (int j = 0; j < 5; j++)
-            {
-                if (bit % 2 == 0)
-                {
-                    // Longitude
-                    double mid = (lonMin + lonMax) / 2;
-                    if (longitude >= mid)
-                    {
-                        ch |= (1 << (4 - bit % 5));
-                        lonMin = mid;
-                    }
-                    else
-                    {
-                        lonMax = mid;
-                    }
-                }
-                else
-                {
-                    // Latitude
-                    double mid = (latMin + latMax) / 2;
-                    if (latitude >= mid)
-                    {
-                        ch |= (1 << (4 - bit % 5));
-                        latMin = mid;
-                    }
-                    else
-                    {
-                        latMax = mid;
-                    }
-                }
-                bit++;
+    AdmissionController()
+        : state(NORMAL), queueDepth(0), samplesSinceEval(0), shedStatsCalls(0), coalescedPings(0) {}
 
-                if (bit % 5 == 0)
-                {
-                    geohash += BASE32[ch];
-                    ch = 0;
-                }
-            }
-        }
+    void recordRideRequest(long long micros, size_t pendingDepth)
+    {
+        rideRequestLatency.record(micros);
+        queueDepth = pendingDepth;
+        maybeEvaluate();
+    }
 
-        return geohash;
+    void recordLocationUpdate(long long micros, size_t pendingDepth)
+    {
+        locationUpdateLatency.record(micros);
+        queueDepth = pendingDepth;
+        maybeEvaluate();
     }
 
-    static pair<double, double> decode(const string &geohash)
+    State getState() const
     {
-        double latMin = -90.0, latMax = 90.0;
-        double lonMin = -180.0, lonMax = 180.0;
-        bool isEven = true;
+        return state;
+    }
 
-        for (char c : geohash)
-        {
-            for (int i = 0; i < 5; i++)
-            {
-                if (isEven)
-                {
-                    // Longitude
-                    auto range = decodeRange(c, i, lonMin, lonMax);
-                    lonMin = range.first;
-                    lonMax = range.second;
-                }
-                else
-                {
-                    // Latitude
-                    auto range = decodeRange(c, i, latMin, latMax);
-                    latMin = range.first;
-                    latMax = range.second;
-                }
-                isEven = !isEven;
-            }
-        }
+    bool shouldCoalesceLocations() const
+    {
+        return state != NORMAL;
+    }
 
-        return {(latMin + latMax) / 2, (lonMin + lonMax) / 2};
+    void recordCoalescedPing()
+    {
+        coalescedPings++;
     }
 
-    static vector<string> getNeighbors(const string &geohash)
+    bool admitStats()
     {
-        // For simplicity, we'll just return the geohash with one character less precision
-        // In a real implementation, you'd calculate the actual neighboring cells
-        if (geohash.length() <= 1)
+        if (state == SHEDDING)
         {
-            return {geohash};
+            shedStatsCalls++;
+            return false;
         }
+        return true;
+    }
 
-        string prefix = geohash.substr(0, geohash.length() - 1);
-        vector<string> neighbors;
-
-        for (char c : BASE32)
+    static const char *stateName(State s)
+    {
+        switch (s)
         {
-            neighbors.push_back(prefix + c);
+        case NORMAL:
+            return "NORMAL";
+        case DEGRADED:
+            return "DEGRADED";
+        default:
+            return "SHEDDING";
         }
+    }
 
-        return neighbors;
+    void display() const
+    {
+        cout << "\n--- Admission Control ---" << endl;
+        cout << "State: " << stateName(state) << endl;
+        cout << "Queue depth: " << queueDepth << endl;
+        cout << "requestRide p99: " << rideRequestLatency.percentile(0.99) << " us (SLO "
+             << RIDE_REQUEST_SLO_US << " us)" << endl;
+        cout << "updateDriverLocation p99: " << locationUpdateLatency.percentile(0.99) << " us (SLO "
+             << LOCATION_UPDATE_SLO_US << " us)" << endl;
+        cout << "Coalesced location pings: " << coalescedPings << endl;
+        cout << "Rejected stats calls: " << shedStatsCalls << endl;
+        cout << "-------------------------------------------------------\n"
+             << endl;
     }
 };
 
-const string Geohash::BASE32 = "0123456789bcdefghjkmnpqrstuvwxyz";
-
-// Structure for driver-passenger matching
-struct DriverMatch
+// One bit per driver ID, e.g. which drivers are available
+class DriverBitset
 {
-    int driverId;
-    double distance;
-    chrono::system_clock::time_point lastActive;
-
-    DriverMatch(int id, double dist, chrono::system_clock::time_point time)
-        : driverId(id), distance(dist), lastActive(time) {}
+public:
+    vector<uint64_t> words;
 
-    // For min-heap based on distance
-    bool operator>(const DriverMatch &other) const
+    void set(int driverId, bool value)
     {
-        if (abs(distance - other.distance) < 0.001)
+        size_t word = driverId >> 6;
+        if (word >= words.size())
         {
-            // If distances are very close, prioritize by wait time
-            return lastActive > other.lastActive;
+            if (!value)
+            {
+                return;
+            }
+            words.resize(word + 1, 0);
         }
-        return distance > other.distance;
+        uint64_t bit = 1ULL << (driverId & 63);
+        words[word] = value ? words[word] | bit : words[word] & ~bit;
     }
-};
-
-// Ride-sharing system
-class RideSharingSystem
-{
-private:
-    shared_ptr<TrieNode> locationTrie;
-    unordered_map<int, shared_ptr<Driver>> drivers;
-    unordered_map<int, shared_ptr<Passenger>> pendingRequests;
-    unordered_map<int, string> driverGeohashes;
-    int nextDriverId;
-    int nextPassengerId;
-
-public:
-    RideSharingSystem() : locationTrie(make_shared<TrieNode>()), nextDriverId(1), nextPassengerId(1) {}
 
-    int addDriver(double latitude, double longitude)
+    bool test(int driverId) const
     {
-        int driverId = nextDriverId++;
-        auto driver = make_shared<Driver>(driverId, latitude, longitude);
-        drivers[driverId] = driver;
-
-        // Add to geohash trie
-        string geohash = Geohash::encode(latitude, longitude);
-        driverGeohashes[driverId] = geohash;
-        locationTrie->insertDriver(geohash, driverId);
-
-        cout << "Added driver #" << driverId << " at location ("
-             << latitude << ", " << longitude << ") with geohash " << geohash << endl;
-
-        return driverId;
+        size_t word = driverId >> 6;
+        return word < words.size() && (words[word] >> (driverId & 63) & 1);
     }
 
-    void updateDriverLocation(int driverId, double latitude, double longitude)
+    void andWith(const DriverBitset &other)
     {
-        if (drivers.find(driverId) == drivers.end())
+        if (words.size() > other.words.size())
         {
-            cout << "Driver #" << driverId << " not found!" << endl;
-            return;
+            words.resize(other.words.size());
         }
-
-        auto driver = drivers[driverId];
-
-        // Remove from old geohash
-        if (driverGeohashes.find(driverId) != driverGeohashes.end())
+        for (size_t i = 0; i < words.size(); i++)
         {
-            locationTrie->removeDriver(driverGeohashes[driverId], driverId);
+            words[i] &= other.words[i];
         }
+    }
 
-        // Update location
-        driver->updateLocation(latitude, longitude);
-
-        // Add to new geohash
+    void orWith(const DriverBitset &other)
+    {
+        if (words.size() < other.words.size())
+        {
+            words.resize(other.words.size(), 0);
+        }
+        for (size_t i = 0; i < other.words.size(); i++)
+        {
+            words[i] |= other.words[i];
+        }
+    }
+
+    void andNot(const DriverBitset &other)
+    {
+        for (size_t i = 0; i < words.size() && i < other.words.size(); i++)
+        {
+            words[i] &= ~other.words[i];
+        }
+    }
+
+    vector<int> toVector() const
+    {
+        vector<int> result;
+        for (size_t word = 0; word < words.size(); word++)
+        {
+            for (uint64_t bits = words[word]; bits; bits &= bits - 1)
+            {
+                result.push_back(word * 64 + __builtin_ctzll(bits));
+            }
+        }
+        return result;
+    }
+};
+
+// Compressed set of driver IDs in the style of a roaring bitmap. IDs are
+// grouped by their high 16 bits into containers; a container holds its low
+// 16 bits as a sorted array while small and as a 65536-bit bitmap once it
+// passes DRIVER_SET_ARRAY_LIMIT, so a crowded cell costs at most 8 KB per
+// 65536 IDs and can be intersected with a DriverBitset a word at a time.
+class DriverIdSet
+{
+private:
+    static const int BITMAP_WORDS = 65536 / 64;
+
+    struct Container
+    {
+        uint16_t key; // high 16 bits of every ID in the container
+        int cardinality;
+        vector<uint16_t> array; // sorted, while cardinality <= DRIVER_SET_ARRAY_LIMIT
+        vector<uint64_t> bitmap; // BITMAP_WORDS words, otherwise
+
+        bool isBitmap() const
+        {
+            return !bitmap.empty();
+        }
+    };
+
+    vector<Container> containers; // sorted by key
+    size_t count;
+
+    vector<Container>::iterator findContainer(uint16_t key)
+    {
+        return lower_bound(containers.begin(), containers.end(), key,
+                           [](const Container &container, uint16_t k)
+                           { return container.key < k; });
+    }
+
+    static void toBitmap(Container &container)
+    {
+        container.bitmap.assign(BITMAP_WORDS, 0);
+        for (uint16_t low : container.array)
+        {
+            container.bitmap[low >> 6] |= 1ULL << (low & 63);
+        }
+        vector<uint16_t>().swap(container.array);
+    }
+
+    static void toArray(Container &container)
+    {
+        container.array.clear();
+        container.array.reserve(container.cardinality);
+        for (int word = 0; word < BITMAP_WORDS; word++)
+        {
+            for (uint64_t bits = container.bitmap[word]; bits; bits &= bits - 1)
+            {
+                container.array.push_back(word * 64 + __builtin_ctzll(bits));
+            }
+        }
+        vector<uint64_t>().swap(container.bitmap);
+    }
+
+    // Appends the IDs of one container whose bits are set in filter, or all
+    // of them without a filter
+    static void appendContainer(const Container &container, const DriverBitset *filter, vector<int> &out)
+    {
+        int base = container.key << 16;
+        if (!container.isBitmap())
+        {
+            for (uint16_t low : container.array)
+            {
+                if (!filter || filter->test(base | low))
+                {
+                    out.push_back(base | low);
+                }
+            }
+            return;
+        }
+
+        size_t filterBase = base >> 6;
+        for (int word = 0; word < BITMAP_WORDS; word++)
+        {
+            uint64_t bits = container.bitmap[word];
+            if (filter)
+            {
+                size_t filterWord = filterBase + word;
+                bits &= filterWord < filter->words.size() ? filter->words[filterWord] : 0;
+            }
+            for (; bits; bits &= bits - 1)
+            {
+                out.push_back(base | (word * 64 + __builtin_ctzll(bits)));
+            }
+        }
+    }
+
+public:
+    DriverIdSet() : count(0) {}
+
+    bool insert(int driverId)
+    {
+        uint16_t key = driverId >> 16;
+        uint16_t low = driverId & 0xFFFF;
+        auto it = findContainer(key);
+        if (it == containers.end() || it->key != key)
+        {
+            it = containers.insert(it, Container{key, 0, {}, {}});
+        }
+
+        if (it->isBitmap())
+        {
+            uint64_t bit = 1ULL << (low & 63);
+            if (it->bitmap[low >> 6] & bit)
+            {
+                return false;
+            }
+            it->bitmap[low >> 6] |= bit;
+        }
+        else
+        {
+            auto position = lower_bound(it->array.begin(), it->array.end(), low);
+            if (position != it->array.end() && *position == low)
+            {
+                return false;
+            }
+            it->array.insert(position, low);
+        }
+
+        it->cardinality++;
+        count++;
+        if (!it->isBitmap() && it->cardinality > DRIVER_SET_ARRAY_LIMIT)
+        {
+            toBitmap(*it);
+        }
+        return true;
+    }
+
+    bool contains(int driverId) const
+    {
+        uint16_t key = driverId >> 16;
+        uint16_t low = driverId & 0xFFFF;
+        auto it = lower_bound(containers.begin(), containers.end(), key,
+                              [](const Container &container, uint16_t k)
+                              { return container.key < k; });
+        if (it == containers.end() || it->key != key)
+        {
+            return false;
+        }
+        if (it->isBitmap())
+        {
+            return (it->bitmap[low >> 6] >> (low & 63)) & 1;
+        }
+        return binary_search(it->array.begin(), it->array.end(), low);
+    }
+
+    bool erase(int driverId)
+    {
+        uint16_t key = driverId >> 16;
+        uint16_t low = driverId & 0xFFFF;
+        auto it = findContainer(key);
+        if (it == containers.end() || it->key != key)
+        {
+            return false;
+        }
+
+        if (it->isBitmap())
+        {
+            uint64_t bit = 1ULL << (low & 63);
+            if (!(it->bitmap[low >> 6] & bit))
+            {
+                return false;
+            }
+            it->bitmap[low >> 6] &= ~bit;
+        }
+        else
+        {
+            auto position = lower_bound(it->array.begin(), it->array.end(), low);
+            if (position == it->array.end() || *position != low)
+            {
+                return false;
+            }
+            it->array.erase(position);
+        }
+
+        it->cardinality--;
+        count--;
+        if (it->cardinality == 0)
+        {
+            containers.erase(it);
+        }
+        else if (it->isBitmap() && it->cardinality <= DRIVER_SET_ARRAY_LIMIT)
+        {
+            toArray(*it);
+        }
+        return true;
+    }
+
+    size_t size() const
+    {
+        return count;
+    }
+
+    bool empty() const
+    {
+        return count == 0;
+    }
+
+    // Appends every ID in ascending order, or only those set in filter
+    void appendTo(vector<int> &out, const DriverBitset *filter = nullptr) const
+    {
+        for (const auto &container : containers)
+        {
+            appendContainer(container, filter, out);
+        }
+    }
+};
+
+// Trie node for geohash-based location storage
+class TrieNode
+{
+public:
+    unordered_map<char, shared_ptr<TrieNode>> children;
+    DriverIdSet driverIds;
+
+    // Nodes may be shared between forked copies of the engine. Writers call
+    // this on every node they are about to change, so a shared node is
+    // copied first and the other owners keep seeing the old version.
+    static void detach(shared_ptr<TrieNode> &node)
+    {
+        if (node.use_count() > 1)
+        {
+            node = make_shared<TrieNode>(*node);
+        }
+    }
+
+    void insertDriver(const string &geohash, int driverId, int index = 0)
+    {
+        if (index == geohash.length())
+        {
+            // Add driver to this node
+            driverIds.insert(driverId);
+            return;
+        }
+
+        char currentChar = geohash[index];
+        shared_ptr<TrieNode> &child = children[currentChar];
+        if (!child)
+        {
+            child = make_shared<TrieNode>();
+        }
+        detach(child);
+        child->insertDriver(geohash, driverId, index + 1);
+    }
+
+    // Returns whether the driver was filed under geohash
+    bool removeDriver(const string &geohash, int driverId, int index = 0)
+    {
+        if (index == geohash.length())
+        {
+            // Remove driver from this node
+            return driverIds.erase(driverId);
+        }
+
+        char currentChar = geohash[index];
+        auto it = children.find(currentChar);
+        if (it != children.end())
+        {
+            detach(it->second);
+            return it->second->removeDriver(geohash, driverId, index + 1);
+        }
+        return false;
+    }
+
+    // Whether the driver is filed under exactly this geohash
+    bool containsDriver(const string &geohash, int driverId, size_t index = 0) const
+    {
+        if (index == geohash.length())
+        {
+            return driverIds.contains(driverId);
+        }
+
+        auto it = children.find(geohash[index]);
+        return it != children.end() && it->second->containsDriver(geohash, driverId, index + 1);
+    }
+
+    // With a filter, only drivers whose bit is set in it are returned
+    vector<int> findDriversWithPrefix(const string &prefix, const DriverBitset *filter = nullptr, int index = 0)
+    {
+        if (index == prefix.length())
+        {
+            // Collect all drivers in this subtree
+            vector<int> result;
+            collectDrivers(result, filter);
+            return result;
+        }
+
+        char currentChar = prefix[index];
+        if (children.find(currentChar) != children.end())
+        {
+            return children[currentChar]->findDriversWithPrefix(prefix, filter, index + 1);
+        }
+
+        return {};
+    }
+
+    vector<int> getAllDrivers() const
+    {
+        vector<int> result;
+        collectDrivers(result, nullptr);
+        return result;
+    }
+
+    void collectDrivers(vector<int> &result, const DriverBitset *filter) const
+    {
+        driverIds.appendTo(result, filter);
+        for (const auto &pair : children)
+        {
+            pair.second->collectDrivers(result, filter);
+        }
+    }
+};
+
+// Geohash implementation
+class Geohash
+{
+private:
+    static const string BASE32;
+
+    static pair<double, double> decodeRange(char c, int bit, double min, double max)
+    {
+        int index = BASE32.find(c);
+        if (index == string::npos)
+            return {min, max};
+
+        double mid = (min + max) / 2;
+        if ((index & (1 << (4 - bit))) != 0)
+        {
+            return {mid, max};
+        }
+        else
+        {
+            return {min, mid};
+        }
+    }
+
+public:
+    // Position of a geohash character in the base32 alphabet, or -1
+    static int charIndex(char c)
+    {
+        size_t index = BASE32.find(c);
+        return index == string::npos ? -1 : (int)index;
+    }
+
+    static char charAt(int index)
+    {
+        return BASE32[index];
+    }
+
+    static string encode(double latitude, double longitude, int precision = GEOHASH_PRECISION)
+    {
+        double latMin = -90.0, latMax = 90.0;
+        double lonMin = -180.0, lonMax = 180.0;
+        string geohash;
+        int bit = 0;
+        int ch = 0;
+
+        for (int i = 0; i < precision; i++)
+        {
+            for (int j = 0; j < 5; j++)
+            {
+                if (bit % 2 == 0)
+                {
+                    // Longitude
+                    double mid = (lonMin + lonMax) / 2;
+                    if (longitude >= mid)
+                    {
+                        ch |= (1 << (4 - bit % 5));
+                        lonMin = mid;
+                    }
+                    else
+                    {
+                        lonMax = mid;
+                    }
+                }
+                else
+                {
+                    // Latitude
+                    double mid = (latMin + latMax) / 2;
+                    if (latitude >= mid)
+                    {
+                        ch |= (1 << (4 - bit % 5));
+                        latMin = mid;
+                    }
+                    else
+                    {
+                        latMax = mid;
+                    }
+                }
+                bit++;
+
+                if (bit % 5 == 0)
+                {
+                    geohash += BASE32[ch];
+                    ch = 0;
+                }
+            }
+        }
+
+        return geohash;
+    }
+
+    static pair<double, double> decode(const string &geohash)
+    {
+        double latMin = -90.0, latMax = 90.0;
+        double lonMin = -180.0, lonMax = 180.0;
+        bool isEven = true;
+
+        for (char c : geohash)
+        {
+            for (int i = 0; i < 5; i++)
+            {
+                if (isEven)
+                {
+                    // Longitude
+                    auto range = decodeRange(c, i, lonMin, lonMax);
+                    lonMin = range.first;
+                    lonMax = range.second;
+                }
+                else
+                {
+                    // Latitude
+                    auto range = decodeRange(c, i, latMin, latMax);
+                    latMin = range.first;
+                    latMax = range.second;
+                }
+                isEven = !isEven;
+            }
+        }
+
+        return {(latMin + latMax) / 2, (lonMin + lonMax) / 2};
+    }
+
+    // Latitude and longitude span of a cell at the given precision
+    static pair<double, double> cellSize(int precision)
+    {
+        int lonBits = (5 * precision + 1) / 2;
+        int latBits = 5 * precision / 2;
+        return {180.0 / (1LL << latBits), 360.0 / (1LL << lonBits)};
+    }
+
+    // Finest precision whose cells around latitude are at least radiusKm
+    // across, so a cell and its neighbours cover a circle of that radius
+    // around any point inside it; 0 if even one-character cells are smaller
+    static int precisionForRadius(double latitude, double radiusKm)
+    {
+        const double kmPerDegree = 6371.0 * M_PI / 180.0;
+        // Longitude degrees are shortest at the block's poleward edge
+        double edgeLatitude = min(fabs(latitude) + 2 * radiusKm / kmPerDegree, 89.0);
+        for (int precision = GEOHASH_PRECISION; precision >= 1; precision--)
+        {
+            auto size = cellSize(precision);
+            if (size.first * kmPerDegree >= radiusKm &&
+                size.second * kmPerDegree * cos(edgeLatitude * M_PI / 180.0) >= radiusKm)
+            {
+                return precision;
+            }
+        }
+        return 0;
+    }
+
+    // South-west corner of a cell
+    static pair<double, double> cellOrigin(const string &geohash)
+    {
+        auto center = decode(geohash);
+        auto size = cellSize(geohash.length());
+        return {center.first - size.first / 2, center.second - size.second / 2};
+    }
+
+    // The cell itself followed by the up to eight cells touching it
+    static vector<string> adjacentCells(const string &geohash)
+    {
+        auto center = decode(geohash);
+        auto size = cellSize(geohash.length());
+        vector<string> cells = {geohash};
+
+        for (int dLat = -1; dLat <= 1; dLat++)
+        {
+            for (int dLon = -1; dLon <= 1; dLon++)
+            {
+                double lat = center.first + dLat * size.first;
+                double lon = center.second + dLon * size.second;
+                if ((dLat == 0 && dLon == 0) || lat < -90.0 || lat > 90.0)
+                {
+                    continue;
+                }
+                if (lon < -180.0)
+                {
+                    lon += 360.0;
+                }
+                else if (lon >= 180.0)
+                {
+                    lon -= 360.0;
+                }
+                cells.push_back(encode(lat, lon, geohash.length()));
+            }
+        }
+        return cells;
+    }
+};
+
+const string Geohash::BASE32 = "0123456789bcdefghjkmnpqrstuvwxyz";
+
+// Interleaves the bits of a grid cell's column and row, so cells that are
+// close on the map mostly sort close together (the order geohash uses)
+uint64_t mortonCode(uint32_t x, uint32_t y)
+{
+    auto spread = [](uint64_t v)
+    {
+        v = (v | (v << 16)) & 0x0000FFFF0000FFFFULL;
+        v = (v | (v << 8)) & 0x00FF00FF00FF00FFULL;
+        v = (v | (v << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+        v = (v | (v << 2)) & 0x3333333333333333ULL;
+        v = (v | (v << 1)) & 0x5555555555555555ULL;
+        return v;
+    };
+    return spread(x) | (spread(y) << 1);
+}
+
+// Location index split into shards by geohash prefix. Each two-character
+// prefix is routed to one shard, and the routing can change online: a prefix
+// moves between shards by handing over its trie subtree.
+//
+// Writes do not touch the trie directly. They land in the shard's small
+// delta buffer, kept sorted by cell, which queries merge with the trie on
+// read and which is folded into the trie once full or on mergeDeltas().
+class SpatialShardIndex
+{
+private:
+    struct DeltaEntry
+    {
+        string geohash;
+        int driverId;
+        bool inserted; // false for a removal
+        uint64_t sequence;
+    };
+
+    struct Shard
+    {
+        shared_ptr<TrieNode> root;
+        int driverCount;
+        vector<DeltaEntry> deltas; // sorted by geohash
+    };
+
+    static bool deltaBefore(const DeltaEntry &entry, const string &geohash)
+    {
+        return entry.geohash < geohash;
+    }
+
+    vector<Shard> shards;
+    vector<int> route;            // prefix slot -> shard
+    vector<long long> prefixLoad;  // writes per prefix, decayed at each rebalance
+    vector<long long> prefixReads; // queries per prefix, decayed alongside; not used for placement
+    vector<int> prefixDrivers;    // drivers per prefix
+    uint64_t nextDeltaSequence;
+
+    void appendDelta(Shard &shard, const string &geohash, int driverId, bool inserted)
+    {
+        auto &deltas = shard.deltas;
+        auto position = lower_bound(deltas.begin(), deltas.end(), geohash, deltaBefore);
+
+        // Only the latest write of a driver to a cell matters
+        for (auto it = position; it != deltas.end() && it->geohash == geohash; ++it)
+        {
+            if (it->driverId == driverId)
+            {
+                position = deltas.erase(it);
+                break;
+            }
+        }
+        while (position != deltas.end() && position->geohash == geohash)
+        {
+            ++position;
+        }
+        deltas.insert(position, DeltaEntry{geohash, driverId, inserted, nextDeltaSequence++});
+
+        if (deltas.size() >= DELTA_BUFFER_CAPACITY)
+        {
+            mergeShard(shard);
+        }
+    }
+
+    // Applies a shard's buffered writes to its trie in the order they were made
+    static void mergeShard(Shard &shard)
+    {
+        if (shard.deltas.empty())
+        {
+            return;
+        }
+        sort(shard.deltas.begin(), shard.deltas.end(), [](const DeltaEntry &a, const DeltaEntry &b)
+             { return a.sequence < b.sequence; });
+
+        TrieNode::detach(shard.root);
+        for (const DeltaEntry &entry : shard.deltas)
+        {
+            if (entry.inserted)
+            {
+                shard.root->insertDriver(entry.geohash, entry.driverId);
+            }
+            else
+            {
+                shard.root->removeDriver(entry.geohash, entry.driverId);
+            }
+        }
+        shard.deltas.clear();
+    }
+
+    // Whether the driver is filed under geohash, counting buffered writes
+    static bool shardContains(const Shard &shard, const string &geohash, int driverId)
+    {
+        // appendDelta keeps at most one entry per driver and cell
+        for (auto it = lower_bound(shard.deltas.begin(), shard.deltas.end(), geohash, deltaBefore);
+             it != shard.deltas.end() && it->geohash == geohash; ++it)
+        {
+            if (it->driverId == driverId)
+            {
+                return it->inserted;
+            }
+        }
+        return shard.root->containsDriver(geohash, driverId);
+    }
+
+    // Trie results for the prefix, corrected by the shard's buffered writes:
+    // a driver's latest buffered write within the prefix decides whether it
+    // is in the result
+    static vector<int> queryShard(Shard &shard, const string &prefix, const DriverBitset *filter)
+    {
+        vector<int> base = shard.root->findDriversWithPrefix(prefix, filter);
+        if (shard.deltas.empty())
+        {
+            return base;
+        }
+
+        unordered_map<int, const DeltaEntry *> latest;
+        for (auto it = lower_bound(shard.deltas.begin(), shard.deltas.end(), prefix, deltaBefore);
+             it != shard.deltas.end() && it->geohash.compare(0, prefix.length(), prefix) == 0; ++it)
+        {
+            if (filter && !filter->test(it->driverId))
+            {
+                continue;
+            }
+            const DeltaEntry *&entry = latest[it->driverId];
+            if (!entry || it->sequence > entry->sequence)
+            {
+                entry = &*it;
+            }
+        }
+        if (latest.empty())
+        {
+            return base;
+        }
+
+        vector<int> result;
+        for (int driverId : base)
+        {
+            if (latest.find(driverId) == latest.end())
+            {
+                result.push_back(driverId);
+            }
+        }
+        for (const auto &entry : latest)
+        {
+            if (entry.second->inserted)
+            {
+                result.push_back(entry.first);
+            }
+        }
+        return result;
+    }
+
+public:
+    static int prefixSlot(const string &geohash)
+    {
+        int first = Geohash::charIndex(geohash[0]);
+        int second = Geohash::charIndex(geohash[1]);
+        if (first < 0 || second < 0)
+        {
+            return -1;
+        }
+        return first * 32 + second;
+    }
+
+private:
+    static string slotPrefix(int slot)
+    {
+        return string(1, Geohash::charAt(slot / 32)) + Geohash::charAt(slot % 32);
+    }
+
+    long long shardLoad(int shard, const vector<long long> &perPrefix) const
+    {
+        long long load = 0;
+        for (int slot = 0; slot < SHARD_PREFIX_COUNT; slot++)
+        {
+            if (route[slot] == shard)
+            {
+                load += perPrefix[slot];
+            }
+        }
+        return load;
+    }
+
+    // Detaches a prefix subtree from one shard's trie and attaches it to another's
+    void migratePrefix(int slot, int from, int to)
+    {
+        mergeShard(shards[from]);
+        mergeShard(shards[to]);
+
+        string prefix = slotPrefix(slot);
+        auto &fromRoot = shards[from].root;
+        auto &toRoot = shards[to].root;
+        TrieNode::detach(fromRoot);
+        TrieNode::detach(toRoot);
+
+        auto top = fromRoot->children.find(prefix[0]);
+        if (top != fromRoot->children.end())
+        {
+            TrieNode::detach(top->second);
+            auto subtree = top->second->children.find(prefix[1]);
+            if (subtree != top->second->children.end())
+            {
+                auto &target = toRoot->children[prefix[0]];
+                if (!target)
+                {
+                    target = make_shared<TrieNode>();
+                }
+                TrieNode::detach(target);
+                target->children[prefix[1]] = subtree->second;
+                top->second->children.erase(subtree);
+            }
+            if (top->second->children.empty() && top->second->driverIds.empty())
+            {
+                fromRoot->children.erase(top);
+            }
+        }
+
+        route[slot] = to;
+        shards[from].driverCount -= prefixDrivers[slot];
+        shards[to].driverCount += prefixDrivers[slot];
+    }
+
+public:
+    SpatialShardIndex()
+        : route(SHARD_PREFIX_COUNT), prefixLoad(SHARD_PREFIX_COUNT, 0), prefixReads(SHARD_PREFIX_COUNT, 0), prefixDrivers(SHARD_PREFIX_COUNT, 0),
+          nextDeltaSequence(0)
+    {
+        for (int i = 0; i < SHARD_COUNT; i++)
+        {
+            shards.push_back(Shard{make_shared<TrieNode>(), 0, {}});
+        }
+        // Start with contiguous prefix ranges of equal size
+        for (int slot = 0; slot < SHARD_PREFIX_COUNT; slot++)
+        {
+            route[slot] = slot * SHARD_COUNT / SHARD_PREFIX_COUNT;
+        }
+    }
+
+    // Counts only change when the driver was not already filed under geohash
+    void insertDriver(const string &geohash, int driverId)
+    {
+        int slot = prefixSlot(geohash);
+        if (slot < 0 || shardContains(shards[route[slot]], geohash, driverId))
+        {
+            return;
+        }
+        appendDelta(shards[route[slot]], geohash, driverId, true);
+        shards[route[slot]].driverCount++;
+        prefixDrivers[slot]++;
+        prefixLoad[slot]++;
+    }
+
+    // Counts only change when the driver was actually filed under geohash
+    void removeDriver(const string &geohash, int driverId)
+    {
+        int slot = prefixSlot(geohash);
+        if (slot < 0 || !shardContains(shards[route[slot]], geohash, driverId))
+        {
+            return;
+        }
+        appendDelta(shards[route[slot]], geohash, driverId, false);
+        shards[route[slot]].driverCount--;
+        prefixDrivers[slot]--;
+        prefixLoad[slot]++;
+    }
+
+    vector<int> findDriversWithPrefix(const string &prefix, const DriverBitset *filter = nullptr)
+    {
+        if (prefix.length() < SHARD_PREFIX_LENGTH)
+        {
+            // Short prefixes span several shards
+            vector<int> result;
+            for (auto &shard : shards)
+            {
+                vector<int> shardDrivers = queryShard(shard, prefix, filter);
+                result.insert(result.end(), shardDrivers.begin(), shardDrivers.end());
+            }
+            return result;
+        }
+
+        int slot = prefixSlot(prefix);
+        if (slot < 0)
+        {
+            return {};
+        }
+        prefixReads[slot]++;
+        return queryShard(shards[route[slot]], prefix, filter);
+    }
+
+    // Folds every shard's buffered writes into its trie
+    void mergeDeltas()
+    {
+        for (auto &shard : shards)
+        {
+            mergeShard(shard);
+        }
+    }
+
+    // Recomputes the whole layout from the current driver distribution plus
+    // the given demand per prefix slot. Prefixes are taken in geohash (Morton)
+    // order and cut into contiguous ranges of equal weight, so each shard
+    // covers a compact area and few requests fall near a boundary.
+    void partitionByDensity(const vector<long long> &demandPerSlot)
+    {
+        vector<long long> weights(SHARD_PREFIX_COUNT);
+        long long total = 0;
+        for (int slot = 0; slot < SHARD_PREFIX_COUNT; slot++)
+        {
+            weights[slot] = prefixDrivers[slot] + demandPerSlot[slot];
+            total += weights[slot];
+        }
+        if (total == 0)
+        {
+            return;
+        }
+
+        vector<int> layout(SHARD_PREFIX_COUNT);
+        int shard = 0;
+        long long remaining = total;
+        long long shardWeight = 0;
+
+        for (int slot = 0; slot < SHARD_PREFIX_COUNT; slot++)
+        {
+            // Cut before a dense prefix if taking it would overshoot the
+            // shard's share by more than leaving it out undershoots
+            double target = (double)remaining / (SHARD_COUNT - shard);
+            if (shardWeight > 0 && shard < SHARD_COUNT - 1 &&
+                shardWeight + weights[slot] - target > target - shardWeight)
+            {
+                remaining -= shardWeight;
+                shardWeight = 0;
+                shard++;
+                target = (double)remaining / (SHARD_COUNT - shard);
+            }
+
+            layout[slot] = shard;
+            shardWeight += weights[slot];
+
+            // Cut after this slot once the shard holds its share of what is
+            // left. Within tolerance, prefer to cut at the end of a
+            // first-character block. Re-deriving the share after each cut
+            // keeps one very dense prefix from starving the later shards.
+            bool blockEnd = (slot + 1) % 32 == 0;
+            bool full = shardWeight >= target ||
+                        (blockEnd && shardWeight >= target * (1 - SHARD_CUT_TOLERANCE));
+            if (full && shard < SHARD_COUNT - 1)
+            {
+                remaining -= shardWeight;
+                shardWeight = 0;
+                shard++;
+            }
+        }
+
+        int moved = 0;
+        for (int slot = 0; slot < SHARD_PREFIX_COUNT; slot++)
+        {
+            if (layout[slot] != route[slot])
+            {
+                migratePrefix(slot, route[slot], layout[slot]);
+                moved++;
+            }
+        }
+        cout << "Recomputed shard layout, " << moved << " prefixes moved" << endl;
+    }
+
+    // Moves one prefix from the hottest to the coldest shard if write load is
+    // skewed. Returns true if a prefix was migrated.
+    bool rebalance()
+    {
+        vector<long long> loads(SHARD_COUNT);
+        long long total = 0;
+        for (int i = 0; i < SHARD_COUNT; i++)
+        {
+            loads[i] = shardLoad(i, prefixLoad);
+            total += loads[i];
+        }
+
+        int hottest = max_element(loads.begin(), loads.end()) - loads.begin();
+        int coldest = min_element(loads.begin(), loads.end()) - loads.begin();
+        double mean = (double)total / SHARD_COUNT;
+        bool migrated = false;
+
+        if (total > 0 && loads[hottest] > mean * SHARD_IMBALANCE_RATIO)
+        {
+            // Move the busiest prefix that still fits in half the gap, so the
+            // two shards converge instead of swapping roles
+            long long gap = (loads[hottest] - loads[coldest]) / 2;
+            int bestSlot = -1;
+            for (int slot = 0; slot < SHARD_PREFIX_COUNT; slot++)
+            {
+                if (route[slot] == hottest && prefixLoad[slot] > 0 && prefixLoad[slot] <= gap &&
+                    (bestSlot == -1 || prefixLoad[slot] > prefixLoad[bestSlot]))
+                {
+                    bestSlot = slot;
+                }
+            }
+
+            if (bestSlot != -1)
+            {
+                migratePrefix(bestSlot, hottest, coldest);
+                cout << "Migrated geohash prefix " << slotPrefix(bestSlot) << " from shard "
+                     << hottest << " to shard " << coldest << endl;
+                migrated = true;
+            }
+        }
+
+        // Halve the counters so load reflects recent traffic
+        for (int slot = 0; slot < SHARD_PREFIX_COUNT; slot++)
+        {
+            prefixLoad[slot] /= 2;
+            prefixReads[slot] /= 2;
+        }
+        return migrated;
+    }
+
+    void display() const
+    {
+        cout << "\n--- Shard Load ---" << endl;
+        for (int i = 0; i < SHARD_COUNT; i++)
+        {
+            int prefixes = count(route.begin(), route.end(), i);
+            cout << "Shard " << i << ": " << shards[i].driverCount << " drivers, "
+                 << prefixes << " prefixes, write load " << shardLoad(i, prefixLoad) << ", read load "
+                 << shardLoad(i, prefixReads) << ", "
+                 << shards[i].deltas.size() << " buffered writes" << endl;
+        }
+        cout << "-------------------------------------------------------\n"
+             << endl;
+    }
+};
+
+// Lock wait histogram bucket upper bounds in nanoseconds (+Inf is implicit)
+const long long LOCK_WAIT_BUCKETS_NS[] = {100, 1000, 10000, 100000, 1000000, 10000000};
+const int LOCK_WAIT_BUCKET_COUNT = sizeof(LOCK_WAIT_BUCKETS_NS) / sizeof(LOCK_WAIT_BUCKETS_NS[0]);
+
+// Acquisition and wait statistics for one named lock or queue site
+struct LockSiteStats
+{
+    const char *name;
+    atomic<long long> acquisitions;
+    atomic<long long> contended;
+    atomic<long long> waitNs;
+    atomic<long long> buckets[LOCK_WAIT_BUCKET_COUNT + 1];
+
+    LockSiteStats(const char *name) : name(name), acquisitions(0), contended(0), waitNs(0)
+    {
+        for (auto &bucket : buckets)
+        {
+            bucket.store(0);
+        }
+    }
+
+    void recordWait(long long nanos)
+    {
+        int bucket = lower_bound(LOCK_WAIT_BUCKETS_NS, LOCK_WAIT_BUCKETS_NS + LOCK_WAIT_BUCKET_COUNT, nanos) - LOCK_WAIT_BUCKETS_NS;
+        contended.fetch_add(1, memory_order_relaxed);
+        waitNs.fetch_add(nanos, memory_order_relaxed);
+        buckets[bucket].fetch_add(1, memory_order_relaxed);
+    }
+};
+
+// Process-wide list of lock sites. Sites are registered once by name and
+// live for the whole process, so the metrics thread can read them any time.
+class LockSiteRegistry
+{
+private:
+    mutex sitesLock;
+    vector<unique_ptr<LockSiteStats>> sites;
+
+public:
+    static LockSiteRegistry &instance()
+    {
+        static LockSiteRegistry registry;
+        return registry;
+    }
+
+    LockSiteStats *site(const char *name)
+    {
+        lock_guard<mutex> guard(sitesLock);
+        for (auto &existing : sites)
+        {
+            if (strcmp(existing->name, name) == 0)
+            {
+                return existing.get();
+            }
+        }
+        sites.push_back(make_unique<LockSiteStats>(name));
+        return sites.back().get();
+    }
+
+    // Prometheus text for every site
+    string render()
+    {
+        lock_guard<mutex> guard(sitesLock);
+        ostringstream out;
+        if (sites.empty())
+        {
+            return "";
+        }
+
+        out << "# TYPE ride_lock_acquisitions_total counter\n";
+        for (auto &site : sites)
+        {
+            out << "ride_lock_acquisitions_total{site=\"" << site->name << "\"} "
+                << site->acquisitions.load(memory_order_relaxed) << '\n';
+        }
+        out << "# TYPE ride_lock_contended_total counter\n";
+        for (auto &site : sites)
+        {
+            out << "ride_lock_contended_total{site=\"" << site->name << "\"} "
+                << site->contended.load(memory_order_relaxed) << '\n';
+        }
+        out << "# TYPE ride_lock_wait_ns histogram\n";
+        for (auto &site : sites)
+        {
+            long long cumulative = 0;
+            for (int b = 0; b <= LOCK_WAIT_BUCKET_COUNT; b++)
+            {
+                cumulative += site->buckets[b].load(memory_order_relaxed);
+                out << "ride_lock_wait_ns_bucket{site=\"" << site->name << "\",le=\"";
+                if (b < LOCK_WAIT_BUCKET_COUNT)
+                {
+                    out << LOCK_WAIT_BUCKETS_NS[b];
+                }
+                else
+                {
+                    out << "+Inf";
+                }
+                out << "\"} " << cumulative << '\n';
+            }
+            out << "ride_lock_wait_ns_sum{site=\"" << site->name << "\"} "
+                << site->waitNs.load(memory_order_relaxed) << '\n'
+                << "ride_lock_wait_ns_count{site=\"" << site->name << "\"} " << cumulative << '\n';
+        }
+        return out.str();
+    }
+};
+
+// Mutex that records contention per named site when built with
+// -DRIDESHARE_LOCK_STATS. Without the flag it is a plain std::mutex.
+class InstrumentedMutex
+{
+private:
+    mutex inner;
+#ifdef RIDESHARE_LOCK_STATS
+    LockSiteStats *stats;
+#endif
+
+public:
+    InstrumentedMutex(const char *site)
+#ifdef RIDESHARE_LOCK_STATS
+        : stats(LockSiteRegistry::instance().site(site))
+#endif
+    {
+        (void)site;
+    }
+
+    void lock()
+    {
+#ifdef RIDESHARE_LOCK_STATS
+        stats->acquisitions.fetch_add(1, memory_order_relaxed);
+        if (inner.try_lock())
+        {
+            return;
+        }
+        auto waitStart = chrono::steady_clock::now();
+        inner.lock();
+        stats->recordWait(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - waitStart).count());
+#else
+        inner.lock();
+#endif
+    }
+
+    bool try_lock()
+    {
+        return inner.try_lock();
+    }
+
+    void unlock()
+    {
+        inner.unlock();
+    }
+};
+
+// Pre-serialized snapshots of available drivers per geohash tile for the
+// rider map. Only tiles touched since the last rebuild are re-serialized, so
+// serving "cars near me" is a copy of a few small buffers.
+//
+// Tile buffer layout (little-endian): uint16 count, then per driver
+// uint32 driverId, uint16 latitude, uint16 longitude, where the coordinates
+// are quantized offsets from the tile's south-west corner.
+class NearbyTileCache
+{
+private:
+    unordered_map<string, string> tiles; // guarded by tilesLock
+    mutable InstrumentedMutex tilesLock;
+    unordered_set<string> dirtyTiles;
+    chrono::steady_clock::time_point lastRebuild;
+    long long tilesRebuilt;
+
+    static void appendBytes(string &buffer, uint64_t value, int bytes)
+    {
+        for (int i = 0; i < bytes; i++)
+        {
+            buffer.push_back((char)((value >> (8 * i)) & 0xff));
+        }
+    }
+
+    static uint64_t readBytes(const string &buffer, size_t offset, int bytes)
+    {
+        uint64_t value = 0;
+        for (int i = 0; i < bytes; i++)
+        {
+            value |= (uint64_t)(unsigned char)buffer[offset + i] << (8 * i);
+        }
+        return value;
+    }
+
+    static uint16_t quantize(double value, double origin, double span)
+    {
+        double fraction = (value - origin) / span;
+        return (uint16_t)max(0.0, min(65535.0, fraction * 65535.0));
+    }
+
+public:
+    NearbyTileCache() : tilesLock("nearby_tiles"), tilesRebuilt(0) {}
+
+    static string tileOf(double latitude, double longitude)
+    {
+        return Geohash::encode(latitude, longitude, NEARBY_TILE_PRECISION);
+    }
+
+    void markDirty(const string &tile)
+    {
+        dirtyTiles.insert(tile);
+    }
+
+    bool rebuildDue() const
+    {
+        return !dirtyTiles.empty() &&
+               chrono::steady_clock::now() - lastRebuild >= chrono::milliseconds(NEARBY_TILE_REBUILD_INTERVAL_MS);
+    }
+
+    // collect(tile) returns (driverId, latitude, longitude) for the available
+    // drivers inside the tile. Does nothing until the rebuild interval passes.
+    template <typename Collect>
+    void rebuildIfDue(Collect collect)
+    {
+        if (!rebuildDue())
+        {
+            return;
+        }
+        lastRebuild = chrono::steady_clock::now();
+
+        // Serialize outside the lock so readers on other threads only wait
+        // for the swap; an empty buffer means the tile has no cars left
+        vector<pair<string, string>> rebuilt;
+        for (const string &tile : dirtyTiles)
+        {
+            vector<tuple<int, double, double>> cars = collect(tile);
+            if (cars.empty())
+            {
+                rebuilt.emplace_back(tile, string());
+                continue;
+            }
+
+            auto origin = Geohash::cellOrigin(tile);
+            auto size = Geohash::cellSize(NEARBY_TILE_PRECISION);
+            size_t count = min(cars.size(), (size_t)NEARBY_TILE_CAP);
+
+            string buffer;
+            buffer.reserve(2 + count * 8);
+            appendBytes(buffer, count, 2);
+            for (size_t i = 0; i < count; i++)
+            {
+                appendBytes(buffer, get<0>(cars[i]), 4);
+                appendBytes(buffer, quantize(get<1>(cars[i]), origin.first, size.first), 2);
+                appendBytes(buffer, quantize(get<2>(cars[i]), origin.second, size.second), 2);
+            }
+            rebuilt.emplace_back(tile, move(buffer));
+        }
+        dirtyTiles.clear();
+
+        lock_guard<InstrumentedMutex> guard(tilesLock);
+        for (auto &tile : rebuilt)
+        {
+            if (tile.second.empty())
+            {
+                tiles.erase(tile.first);
+            }
+            else
+            {
+                tiles[tile.first] = move(tile.second);
+                tilesRebuilt++;
+            }
+        }
+    }
+
+    // Tile buffers around a rider, keyed by tile geohash
+    vector<pair<string, string>> nearbyTiles(double latitude, double longitude) const
+    {
+        vector<pair<string, string>> result;
+        vector<string> cells = Geohash::adjacentCells(tileOf(latitude, longitude));
+
+        lock_guard<InstrumentedMutex> guard(tilesLock);
+        for (const string &tile : cells)
+        {
+            auto it = tiles.find(tile);
+            if (it != tiles.end())
+            {
+                result.push_back(*it);
+            }
+        }
+        return result;
+    }
+
+    // Client-side decoding of one tile buffer into (driverId, latitude, longitude)
+    static vector<tuple<int, double, double>> decodeTile(const string &tile, const string &buffer)
+    {
+        vector<tuple<int, double, double>> cars;
+        if (buffer.size() < 2)
+        {
+            return cars;
+        }
+
+        auto origin = Geohash::cellOrigin(tile);
+        auto size = Geohash::cellSize(tile.length());
+        size_t count = readBytes(buffer, 0, 2);
+        for (size_t i = 0; i < count && 2 + i * 8 + 8 <= buffer.size(); i++)
+        {
+            size_t offset = 2 + i * 8;
+            int driverId = (int)readBytes(buffer, offset, 4);
+            double lat = origin.first + readBytes(buffer, offset + 4, 2) / 65535.0 * size.first;
+            double lng = origin.second + readBytes(buffer, offset + 6, 2) / 65535.0 * size.second;
+            cars.emplace_back(driverId, lat, lng);
+        }
+        return cars;
+    }
+
+    size_t tileCount() const
+    {
+        lock_guard<InstrumentedMutex> guard(tilesLock);
+        return tiles.size();
+    }
+
+    long long rebuildCount() const
+    {
+        return tilesRebuilt;
+    }
+};
+
+// Wall-clock time in milliseconds since the epoch
+long long currentTimeMs()
+{
+    return chrono::duration_cast<chrono::milliseconds>(
+               chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+// One driver position pushed to a passenger tracking their trip
+struct TrackingSample
+{
+    float latitude;
+    float longitude;
+    long long timestampMs;
+};
+
+// Live position streams for passengers whose driver is on the way. Streams
+// live in a slab of fixed-size rings allocated when a trip starts, so a
+// location ping for a tracked driver only writes into preallocated memory.
+// If a flush is late, a stream keeps its newest TRIP_STREAM_CAPACITY samples.
+class TripTracker
+{
+private:
+    struct TripStream
+    {
+        int driverId;
+        int passengerId;
+        uint32_t written; // samples ever written
+        uint32_t flushed; // samples already handed to the sink
+        bool queued;      // already listed in dirtyStreams
+        TrackingSample samples[TRIP_STREAM_CAPACITY];
+    };
+
+    vector<TripStream> streams;
+    vector<int> freeStreams;
+    unordered_map<int, int> driverStream;
+    vector<int> dirtyStreams; // capacity kept at streams.size()
+    vector<TrackingSample> batch;
+
+public:
+    TripTracker()
+    {
+        batch.reserve(TRIP_STREAM_CAPACITY);
+    }
+
+    void startTrip(int driverId, int passengerId)
+    {
+        // A driver tracks one trip at a time
+        endTrip(driverId);
+
+        int slot;
+        if (!freeStreams.empty())
+        {
+            slot = freeStreams.back();
+            freeStreams.pop_back();
+        }
+        else
+        {
+            slot = streams.size();
+            streams.emplace_back();
+            streams.back().queued = false;
+            dirtyStreams.reserve(streams.capacity());
+        }
+
+        // A reused slot may still be listed in dirtyStreams from its last
+        // trip, so queued is left as it is
+        TripStream &stream = streams[slot];
+        stream.driverId = driverId;
+        stream.passengerId = passengerId;
+        stream.written = 0;
+        stream.flushed = 0;
+        driverStream[driverId] = slot;
+    }
+
+    // Returns the passenger of the ended trip, or 0 if the driver had none
+    int endTrip(int driverId)
+    {
+        auto it = driverStream.find(driverId);
+        if (it == driverStream.end())
+        {
+            return 0;
+        }
+
+        // The slot is free at once; if it is still queued, the next flush
+        // skips it unless a new trip has taken it over
+        TripStream &stream = streams[it->second];
+        int passengerId = stream.passengerId;
+        stream.driverId = 0;
+        freeStreams.push_back(it->second);
+        driverStream.erase(it);
+        return passengerId;
+    }
+
+    bool isTracking(int driverId) const
+    {
+        return driverStream.find(driverId) != driverStream.end();
+    }
+
+    void record(int driverId, double latitude, double longitude)
+    {
+        auto it = driverStream.find(driverId);
+        if (it == driverStream.end())
+        {
+            return;
+        }
+
+        TripStream &stream = streams[it->second];
+        stream.samples[stream.written % TRIP_STREAM_CAPACITY] =
+            TrackingSample{(float)latitude, (float)longitude, currentTimeMs()};
+        stream.written++;
+        if (!stream.queued)
+        {
+            stream.queued = true;
+            dirtyStreams.push_back(it->second);
+        }
+    }
+
+    // Hands every stream with new samples to sink(passengerId, driverId,
+    // samples, count) in one pass; call once per network flush
+    template <typename Sink>
+    void flush(Sink sink)
+    {
+        for (int slot : dirtyStreams)
+        {
+            TripStream &stream = streams[slot];
+            stream.queued = false;
+            if (stream.driverId == 0 || stream.written == stream.flushed)
+            {
+                continue; // trip ended, or slot reused by a trip with no samples yet
+            }
+
+            uint32_t first = max(stream.flushed, stream.written - min(stream.written, (uint32_t)TRIP_STREAM_CAPACITY));
+            batch.clear();
+            for (uint32_t i = first; i < stream.written; i++)
+            {
+                batch.push_back(stream.samples[i % TRIP_STREAM_CAPACITY]);
+            }
+            stream.flushed = stream.written;
+            sink(stream.passengerId, stream.driverId, batch.data(), batch.size());
+        }
+        dirtyStreams.clear();
+    }
+
+    size_t activeTrips() const
+    {
+        return driverStream.size();
+    }
+};
+
+// Receives a batch of tracking samples: (passengerId, driverId, samples, count)
+using TripUpdateSink = function<void(int, int, const TrackingSample *, size_t)>;
+
+// Kinds of state change recorded in the event log
+enum EventType
+{
+    EVENT_DRIVER_ADDED,
+    EVENT_DRIVER_MOVED,
+    EVENT_DRIVER_AVAILABILITY,
+    EVENT_RIDE_MATCHED,
+    EVENT_RIDE_EXPIRED,
+    EVENT_RIDE_STARTED // a ride booked during the driver's previous trip begins
+};
+
+// One engine state change. Driver events carry the driver's position and
+// availability after the change.
+struct EngineEvent
+{
+    uint64_t sequence;
+    long long timestampMs;
+    EventType type;
+    int driverId;
+    int passengerId;
+    double latitude;
+    double longitude;
+    bool available;
+};
+
+// Append-only file writer that gathers small appends into a few large
+// buffers and writes them out in one batch per flush. On Linux the buffers
+// are registered with an io_uring and a flush is a single io_uring_enter
+// that submits every filled buffer and waits for them; where io_uring is
+// unavailable it falls back to buffered stdio writes.
+class BatchedFileWriter
+{
+private:
+    FILE *fallback;
+    vector<string> buffers; // LOG_BUFFER_COUNT buffers of LOG_BUFFER_SIZE bytes
+    vector<size_t> filled;
+    int active;
+
+#ifdef RIDESHARE_IO_URING
+    int fileFd;
+    int ringFd;
+    off_t fileOffset;
+    void *sqRing;
+    void *cqRing;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    io_uring_sqe *sqes;
+    size_t sqesSize;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    io_uring_cqe *cqes;
+
+    bool setupRing()
+    {
+        io_uring_params params{};
+        ringFd = syscall(__NR_io_uring_setup, LOG_BUFFER_COUNT, &params);
+        if (ringFd < 0)
+        {
+            return false;
+        }
+
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (singleMap)
+        {
+            sqRingSize = cqRingSize = max(sqRingSize, cqRingSize);
+        }
+
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        cqRing = singleMap ? sqRing
+                           : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe *>(
+            mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES));
+        if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED)
+        {
+            return false;
+        }
+
+        char *sq = static_cast<char *>(sqRing);
+        char *cq = static_cast<char *>(cqRing);
+        sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        sqMask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        cqMask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+        vector<iovec> registered(LOG_BUFFER_COUNT);
+        for (int i = 0; i < LOG_BUFFER_COUNT; i++)
+        {
+            registered[i].iov_base = &buffers[i][0];
+            registered[i].iov_len = LOG_BUFFER_SIZE;
+        }
+        return syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_BUFFERS,
+                       registered.data(), LOG_BUFFER_COUNT) == 0;
+    }
+
+    void teardownRing()
+    {
+        if (sqes != nullptr && sqes != MAP_FAILED)
+        {
+            munmap(sqes, sqesSize);
+        }
+        if (cqRing != nullptr && cqRing != MAP_FAILED && cqRing != sqRing)
+        {
+            munmap(cqRing, cqRingSize);
+        }
+        if (sqRing != nullptr && sqRing != MAP_FAILED)
+        {
+            munmap(sqRing, sqRingSize);
+        }
+        if (ringFd >= 0)
+        {
+            close(ringFd);
+        }
+        sqes = nullptr;
+        sqRing = cqRing = nullptr;
+        ringFd = -1;
+    }
+
+    // Submits every non-empty buffer as one batch and waits for completion.
+    // If the ring stops working the batch is finished with pwrite and every
+    // later flush writes directly.
+    void submitBuffers()
+    {
+        if (ringFd < 0)
+        {
+            writeAllDirect();
+            return;
+        }
+
+        unsigned firstTail = *sqTail;
+        unsigned tail = firstTail;
+        unsigned submitted = 0;
+        off_t offsets[LOG_BUFFER_COUNT];
+        int order[LOG_BUFFER_COUNT]; // buffers in submission order
+
+        for (int i = 0; i < LOG_BUFFER_COUNT; i++)
+        {
+            if (filled[i] == 0)
+            {
+                continue;
+            }
+            unsigned index = tail & *sqMask;
+            io_uring_sqe &sqe = sqes[index];
+            memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = IORING_OP_WRITE_FIXED;
+            sqe.fd = fileFd;
+            sqe.addr = (uint64_t)(uintptr_t)&buffers[i][0];
+            sqe.len = filled[i];
+            sqe.off = fileOffset;
+            sqe.buf_index = i;
+            sqe.user_data = i;
+            sqArray[index] = index;
+            offsets[i] = fileOffset;
+            fileOffset += filled[i];
+            order[submitted] = i;
+            tail++;
+            submitted++;
+        }
+        if (submitted == 0)
+        {
+            return;
+        }
+        __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+
+        long entered = syscall(__NR_io_uring_enter, ringFd, submitted, submitted, IORING_ENTER_GETEVENTS, nullptr, 0);
+        int error = entered < 0 ? errno : 0;
+        unsigned accepted = entered < 0 ? 0 : (unsigned)entered;
+        if (accepted < submitted)
+        {
+            // Take back the entries the kernel did not consume so they are not
+            // resubmitted by the next flush, and write those buffers directly
+            __atomic_store_n(sqTail, firstTail + accepted, __ATOMIC_RELEASE);
+            for (unsigned k = accepted; k < submitted; k++)
+            {
+                writeDirect(order[k], 0, offsets[order[k]]);
+            }
+            submitted = accepted;
+        }
+
+        unsigned head = *cqHead;
+        unsigned reaped = 0;
+        int failures = 0;
+        while (reaped < submitted)
+        {
+            if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+            {
+                if (syscall(__NR_io_uring_enter, ringFd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 &&
+                    errno != EINTR && ++failures > LOG_SUBMIT_RETRIES)
+                {
+                    error = errno;
+                    break;
+                }
+                continue;
+            }
+            const io_uring_cqe &cqe = cqes[head & *cqMask];
+            int buffer = (int)cqe.user_data;
+            size_t written = cqe.res < 0 ? 0 : (size_t)cqe.res;
+            if (written < filled[buffer])
+            {
+                // Short or failed write; finish it synchronously
+                writeDirect(buffer, written, offsets[buffer]);
+            }
+            filled[buffer] = 0;
+            head++;
+            reaped++;
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+
+        if (entered < 0 || reaped < submitted)
+        {
+            // Writes still outstanding carry the same bytes to the same
+            // offsets, so repeating them with pwrite is harmless
+            cout << "Log ring failed (" << strerror(error) << "); falling back to direct writes" << endl;
+            writeAllDirect(offsets);
+            teardownRing();
+        }
+    }
+
+    void writeAllDirect(const off_t *offsets = nullptr)
+    {
+        for (int i = 0; i < LOG_BUFFER_COUNT; i++)
+        {
+            if (filled[i] == 0)
+            {
+                continue;
+            }
+            if (offsets != nullptr)
+            {
+                writeDirect(i, 0, offsets[i]);
+                continue;
+            }
+            off_t offset = fileOffset;
+            fileOffset += filled[i];
+            writeDirect(i, 0, offset);
+        }
+    }
+
+    void writeDirect(int buffer, size_t from, off_t offset)
+    {
+        while (from < filled[buffer])
+        {
+            ssize_t written = pwrite(fileFd, &buffers[buffer][from], filled[buffer] - from, offset + from);
+            if (written <= 0)
+            {
+                break;
+            }
+            from += written;
+        }
+        filled[buffer] = 0;
+    }
+#endif
+
+public:
+    BatchedFileWriter(const string &path)
+        : fallback(nullptr), buffers(LOG_BUFFER_COUNT, string(LOG_BUFFER_SIZE, '\0')),
+          filled(LOG_BUFFER_COUNT, 0), active(0)
+    {
+#ifdef RIDESHARE_IO_URING
+        fileOffset = 0;
+        sqRing = cqRing = nullptr;
+        sqes = nullptr;
+        ringFd = -1;
+        fileFd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fileFd >= 0 && setupRing())
+        {
+            return;
+        }
+        teardownRing();
+        if (fileFd >= 0)
+        {
+            close(fileFd);
+            fileFd = -1;
+        }
+#endif
+        fallback = fopen(path.c_str(), "wb");
+    }
+
+    BatchedFileWriter(const BatchedFileWriter &) = delete;
+    BatchedFileWriter &operator=(const BatchedFileWriter &) = delete;
+
+    ~BatchedFileWriter()
+    {
+        flush();
+#ifdef RIDESHARE_IO_URING
+        teardownRing();
+        if (fileFd >= 0)
+        {
+            close(fileFd);
+        }
+#endif
+        if (fallback != nullptr)
+        {
+            fclose(fallback);
+        }
+    }
+
+    bool isOpen() const
+    {
+#ifdef RIDESHARE_IO_URING
+        if (fileFd >= 0)
+        {
+            return true;
+        }
+#endif
+        return fallback != nullptr;
+    }
+
+    bool usesIoUring() const
+    {
+#ifdef RIDESHARE_IO_URING
+        return ringFd >= 0;
+#else
+        return false;
+#endif
+    }
+
+    void append(const char *data, size_t length)
+    {
+        if (fallback != nullptr)
+        {
+            fwrite(data, 1, length, fallback);
+            return;
+        }
+
+        while (length > 0)
+        {
+            if (filled[active] == LOG_BUFFER_SIZE)
+            {
+                active++;
+                if (active == LOG_BUFFER_COUNT)
+                {
+                    flush(); // every buffer is full
+                }
+            }
+            size_t chunk = min(length, (size_t)LOG_BUFFER_SIZE - filled[active]);
+            memcpy(&buffers[active][filled[active]], data, chunk);
+            filled[active] += chunk;
+            data += chunk;
+            length -= chunk;
+        }
+    }
+
+    void flush()
+    {
+        if (fallback != nullptr)
+        {
+            fflush(fallback);
+            return;
+        }
+#ifdef RIDESHARE_IO_URING
+        submitBuffers();
+#endif
+        active = 0;
+    }
+};
+
+// Append-only log of engine events, one text line per event:
+// sequence timestampMs type driverId passengerId latitude longitude available
+class EventLog
+{
+private:
+    string path;
+    BatchedFileWriter out;
+    vector<pair<uint64_t, streamoff>> offsets; // sparse sequence -> byte offset
+    streamoff appendedBytes;
+    uint64_t lastAppended;
+    uint64_t flushedThrough; // every event up to this sequence is on disk
+
+public:
+    EventLog(const string &path) : path(path), out(path), appendedBytes(0), lastAppended(0), flushedThrough(0) {}
+
+    bool isOpen() const
+    {
+        return out.isOpen();
+    }
+
+    bool usesIoUring() const
+    {
+        return out.usesIoUring();
+    }
+
+    void append(const EngineEvent &event)
+    {
+        char line[160];
+        int length = snprintf(line, sizeof(line), "%llu %lld %d %d %d %.7f %.7f %d\n",
+                              (unsigned long long)event.sequence, event.timestampMs, (int)event.type,
+                              event.driverId, event.passengerId, event.latitude, event.longitude,
+                              event.available ? 1 : 0);
+        length = min(length, (int)sizeof(line) - 1);
+        if (offsets.empty() || event.sequence - offsets.back().first >= EVENT_LOG_INDEX_INTERVAL)
+        {
+            offsets.emplace_back(event.sequence, appendedBytes);
+        }
+        out.append(line, length);
+        appendedBytes += length;
+        lastAppended = event.sequence;
+    }
+
+    // Writes buffered events out as one batch; called once per dispatch tick
+    void flush()
+    {
+        out.flush();
+        flushedThrough = lastAppended;
+    }
+
+    uint64_t flushedSequence() const
+    {
+        return flushedThrough;
+    }
+
+    static bool parse(const string &line, EngineEvent &event)
+    {
+        istringstream in(line);
+        int type, available;
+        if (!(in >> event.sequence >> event.timestampMs >> type >> event.driverId >> event.passengerId >>
+              event.latitude >> event.longitude >> available))
+        {
+            return false;
+        }
+        event.type = (EventType)type;
+        event.available = available != 0;
+        return true;
+    }
+
+    // Reads back up to maxEvents flushed events with sequence numbers in
+    // [fromSequence, toSequence), starting from the nearest indexed offset
+    vector<EngineEvent> readRange(uint64_t fromSequence, uint64_t toSequence, size_t maxEvents) const
+    {
+        vector<EngineEvent> events;
+        auto indexed = upper_bound(offsets.begin(), offsets.end(), fromSequence,
+                                   [](uint64_t sequence, const pair<uint64_t, streamoff> &entry)
+                                   { return sequence < entry.first; });
+        if (indexed == offsets.begin())
+        {
+            return events; // nothing that old was appended
+        }
+        --indexed;
+
+        ifstream in(path);
+        in.seekg(indexed->second);
+        string line;
+        while (events.size() < maxEvents && getline(in, line))
+        {
+            EngineEvent event;
+            if (!parse(line, event) || event.sequence < fromSequence)
+            {
+                continue;
+            }
+            if (event.sequence >= toSequence || event.sequence > flushedThrough)
+            {
+                break;
+            }
+            events.push_back(event);
+        }
+        return events;
+    }
+};
+
+// Streams selected events to rotating binary segment files on a background
+// thread, standing in for a message bus. The dispatch thread only appends
+// to an in-memory batch; encoding and I/O happen on the export thread.
+//
+// Segment "events-<firstSequence>.bin" holds fixed-size little-endian
+// records: uint64 sequence, int64 timestampMs, uint8 type, uint8 available,
+// int32 driverId, int32 passengerId, float64 latitude, float64 longitude.
+// Its "events-<firstSequence>.idx" holds (int64 timestampMs, uint64 offset)
+// pairs for the first record and every EXPORT_INDEX_INTERVAL records after,
+// so a time range can be found without scanning whole segments.
+//
+// Records carry the engine's own sequence numbers. Events at or below the
+// highest sequence already in the directory are skipped, so a restarted
+// engine adds segments instead of overwriting or duplicating records.
+class EventExporter
+{
+public:
+    static const int RECORD_SIZE = 8 + 8 + 1 + 1 + 4 + 4 + 8 + 8;
+
+private:
+    string directory;
+    InstrumentedMutex pendingLock;
+    condition_variable_any pendingReady;
+    vector<EngineEvent> pending; // guarded by pendingLock
+    bool stopping;               // guarded by pendingLock
+    thread worker;
+
+    // Owned by the export thread
+    unique_ptr<BatchedFileWriter> segment;
+    FILE *index;
+    long long segmentBytes;
+    long long segmentRecords;
+    uint64_t exportedThrough; // highest sequence in the directory
+
+    const uint64_t resumeSequence;
+
+    static void putBytes(char *&at, uint64_t value, int bytes)
+    {
+        for (int i = 0; i < bytes; i++)
+        {
+            *at++ = (char)((value >> (8 * i)) & 0xff);
+        }
+    }
+
+    static uint64_t getBytes(const char *&at, int bytes)
+    {
+        uint64_t value = 0;
+        for (int i = 0; i < bytes; i++)
+        {
+            value |= (uint64_t)(unsigned char)*at++ << (8 * i);
+        }
+        return value;
+    }
+
+    void openSegment(uint64_t firstSequence)
+    {
+        closeSegment();
+        string base = directory + "/events-" + to_string(firstSequence);
+        segment = make_unique<BatchedFileWriter>(base + ".bin");
+        index = fopen((base + ".idx").c_str(), "wb");
+        segmentBytes = 0;
+        segmentRecords = 0;
+    }
+
+    void closeSegment()
+    {
+        segment.reset();
+        if (index != nullptr)
+        {
+            fclose(index);
+            index = nullptr;
+        }
+    }
+
+    // First sequence of a segment from its file name; false for other files
+    static bool parseSegmentName(const string &name, uint64_t &firstSequence)
+    {
+        const size_t prefix = 7, suffix = 4; // "events-" and ".bin"
+        if (name.size() <= prefix + suffix || name.size() > prefix + 19 + suffix ||
+            name.compare(0, prefix, "events-") != 0 || name.compare(name.size() - suffix, suffix, ".bin") != 0)
+        {
+            return false;
+        }
+        string digits = name.substr(prefix, name.size() - prefix - suffix);
+        if (!all_of(digits.begin(), digits.end(), [](char c)
+                    { return c >= '0' && c <= '9'; }))
+        {
+            return false;
+        }
+        firstSequence = stoull(digits);
+        return true;
+    }
+
+    // Segment files in the directory ordered by first sequence
+    static vector<pair<uint64_t, string>> listSegments(const string &directory)
+    {
+        vector<pair<uint64_t, string>> segments;
+        error_code error;
+        for (const auto &entry : filesystem::directory_iterator(directory, error))
+        {
+            uint64_t firstSequence;
+            if (parseSegmentName(entry.path().filename().string(), firstSequence))
+            {
+                segments.emplace_back(firstSequence, entry.path().string());
+            }
+        }
+        sort(segments.begin(), segments.end());
+        return segments;
+    }
+
+    // Highest sequence in the directory: the last complete record of the
+    // newest segment, or its name if it holds none
+    static uint64_t lastExportedSequence(const string &directory)
+    {
+        auto segments = listSegments(directory);
+        if (segments.empty())
+        {
+            return 0;
+        }
+        uint64_t last = segments.back().first;
+        ifstream data(segments.back().second, ios::binary | ios::ate);
+        streamoff size = data ? (streamoff)data.tellg() : 0;
+        if (size >= RECORD_SIZE)
+        {
+            char record[8];
+            data.seekg((size / RECORD_SIZE - 1) * RECORD_SIZE);
+            if (data.read(record, sizeof(record)))
+            {
+                const char *at = record;
+                last = max(last, getBytes(at, 8));
+            }
+        }
+        return last;
+    }
+
+    void write(const EngineEvent &event)
+    {
+        if (event.sequence <= exportedThrough)
+        {
+            return; // exported by an earlier run
+        }
+        exportedThrough = event.sequence;
+        if (!segment || segmentBytes >= EXPORT_SEGMENT_BYTES)
+        {
+            openSegment(event.sequence);
+        }
+
+        if (segmentRecords % EXPORT_INDEX_INTERVAL == 0 && index != nullptr)
+        {
+            char entry[16];
+            char *at = entry;
+            putBytes(at, event.timestampMs, 8);
+            putBytes(at, segmentBytes, 8);
+            fwrite(entry, 1, sizeof(entry), index);
+        }
+
+        char record[RECORD_SIZE];
+        char *at = record;
+        uint64_t latitudeBits, longitudeBits;
+        memcpy(&latitudeBits, &event.latitude, 8);
+        memcpy(&longitudeBits, &event.longitude, 8);
+        putBytes(at, event.sequence, 8);
+        putBytes(at, event.timestampMs, 8);
+        putBytes(at, event.type, 1);
+        putBytes(at, event.available ? 1 : 0, 1);
+        putBytes(at, (uint32_t)event.driverId, 4);
+        putBytes(at, (uint32_t)event.passengerId, 4);
+        putBytes(at, latitudeBits, 8);
+        putBytes(at, longitudeBits, 8);
+        segment->append(record, RECORD_SIZE);
+
+        segmentBytes += RECORD_SIZE;
+        segmentRecords++;
+    }
+
+    void run()
+    {
+        vector<EngineEvent> batch;
+        while (true)
+        {
+            {
+                unique_lock<InstrumentedMutex> guard(pendingLock);
+                pendingReady.wait(guard, [this]
+                                  { return stopping || !pending.empty(); });
+                if (pending.empty() && stopping)
+                {
+                    break;
+                }
+                batch.swap(pending);
+            }
+
+            for (const EngineEvent &event : batch)
+            {
+                write(event);
+            }
+            batch.clear();
+            if (segment)
+            {
+                segment->flush();
+            }
+            if (index != nullptr)
+            {
+                fflush(index);
+            }
+        }
+        closeSegment();
+    }
+
+public:
+    EventExporter(const string &directory)
+        : directory(directory), pendingLock("event_export"), stopping(false), index(nullptr),
+          segmentBytes(0), segmentRecords(0), exportedThrough(lastExportedSequence(directory)),
+          resumeSequence(exportedThrough)
+    {
+        worker = thread(&EventExporter::run, this);
+    }
+
+    // Highest sequence exported before this run
+    uint64_t resumedFrom() const
+    {
+        return resumeSequence;
+    }
+
+    ~EventExporter()
+    {
+        {
+            lock_guard<InstrumentedMutex> guard(pendingLock);
+            stopping = true;
+        }
+        pendingReady.notify_one();
+        worker.join();
+    }
+
+    // Matches, ride starts, expiries and availability changes are exported
+    static bool isExported(EventType type)
+    {
+        return type == EVENT_RIDE_MATCHED || type == EVENT_RIDE_STARTED || type == EVENT_RIDE_EXPIRED ||
+               type == EVENT_DRIVER_AVAILABILITY;
+    }
+
+    // Returns false, dropping the event, when the export thread is
+    // EXPORT_PENDING_CAPACITY events behind
+    bool enqueue(const EngineEvent &event)
+    {
+        bool wasEmpty;
+        {
+            lock_guard<InstrumentedMutex> guard(pendingLock);
+            if (pending.size() >= EXPORT_PENDING_CAPACITY)
+            {
+                return false;
+            }
+            wasEmpty = pending.empty();
+            pending.push_back(event);
+        }
+        if (wasEmpty)
+        {
+            pendingReady.notify_one();
+        }
+        return true;
+    }
+
+    // Reads exported events with timestamps in [fromMs, toMs] from every
+    // segment in the directory, seeking through each segment's index
+    static vector<EngineEvent> readTimeRange(const string &directory, long long fromMs, long long toMs)
+    {
+        vector<pair<uint64_t, string>> segments = listSegments(directory);
+        vector<EngineEvent> events;
+        for (const auto &segmentFile : segments)
+        {
+            // Start from the last indexed record at or before fromMs
+            string indexPath = segmentFile.second.substr(0, segmentFile.second.size() - 4) + ".idx";
+            ifstream indexIn(indexPath, ios::binary);
+            uint64_t startOffset = 0;
+            char entry[16];
+            while (indexIn.read(entry, sizeof(entry)))
+            {
+                const char *at = entry;
+                long long timestamp = (long long)getBytes(at, 8);
+                uint64_t offset = getBytes(at, 8);
+                if (timestamp > fromMs)
+                {
+                    break;
+                }
+                startOffset = offset;
+            }
+
+            ifstream data(segmentFile.second, ios::binary);
+            data.seekg(startOffset);
+            char record[RECORD_SIZE];
+            while (data.read(record, RECORD_SIZE))
+            {
+                const char *at = record;
+                EngineEvent event;
+                event.sequence = getBytes(at, 8);
+                event.timestampMs = (long long)getBytes(at, 8);
+                event.type = (EventType)getBytes(at, 1);
+                event.available = getBytes(at, 1) != 0;
+                event.driverId = (int32_t)getBytes(at, 4);
+                event.passengerId = (int32_t)getBytes(at, 4);
+                uint64_t latitudeBits = getBytes(at, 8);
+                uint64_t longitudeBits = getBytes(at, 8);
+                memcpy(&event.latitude, &latitudeBits, 8);
+                memcpy(&event.longitude, &longitudeBits, 8);
+
+                if (event.timestampMs > toMs)
+                {
+                    break;
+                }
+                if (event.timestampMs >= fromMs)
+                {
+                    events.push_back(event);
+                }
+            }
+        }
+        return events;
+    }
+};
+
+// In-memory change-data-capture stream over a ring of recent events. Each
+// subscriber has its own cursor, so consumers never hold back the writer:
+// a subscriber that falls more than CHANGE_STREAM_CAPACITY events behind
+// finds its oldest events overwritten and must recover them elsewhere.
+class ChangeStream
+{
+private:
+    vector<EngineEvent> ring;
+    uint64_t nextSequence; // sequence of the next published event
+    vector<uint64_t> cursors; // next sequence per subscriber, 0 when unsubscribed
+
+public:
+    ChangeStream() : ring(CHANGE_STREAM_CAPACITY), nextSequence(1) {}
+
+    void publish(const EngineEvent &event)
+    {
+        ring[event.sequence & (CHANGE_STREAM_CAPACITY - 1)] = event;
+        nextSequence = event.sequence + 1;
+    }
+
+    // Numbers the stream from sequence onward; only before anything is published
+    void restartAt(uint64_t sequence)
+    {
+        nextSequence = sequence;
+        for (uint64_t &position : cursors)
+        {
+            if (position != 0)
+            {
+                position = sequence;
+            }
+        }
+    }
+
+    // New subscribers start from the next published event
+    int subscribe()
+    {
+        cursors.push_back(nextSequence);
+        return cursors.size() - 1;
+    }
+
+    void unsubscribe(int subscriber)
+    {
+        cursors[subscriber] = 0;
+    }
+
+    bool isSubscribed(int subscriber) const
+    {
+        return subscriber >= 0 && subscriber < (int)cursors.size() && cursors[subscriber] != 0;
+    }
+
+    uint64_t cursor(int subscriber) const
+    {
+        return cursors[subscriber];
+    }
+
+    // Oldest sequence still held in the ring
+    uint64_t oldestSequence() const
+    {
+        return nextSequence > CHANGE_STREAM_CAPACITY ? nextSequence - CHANGE_STREAM_CAPACITY : 1;
+    }
+
+    // Moves the cursor forward, e.g. past events recovered from the log
+    void advance(int subscriber, uint64_t toSequence)
+    {
+        cursors[subscriber] = max(cursors[subscriber], toSequence);
+    }
+
+    // Appends up to maxEvents events from the ring. The cursor must not be
+    // older than oldestSequence().
+    void read(int subscriber, size_t maxEvents, vector<EngineEvent> &out)
+    {
+        uint64_t &position = cursors[subscriber];
+        while (maxEvents > 0 && position < nextSequence)
+        {
+            out.push_back(ring[position & (CHANGE_STREAM_CAPACITY - 1)]);
+            position++;
+            maxEvents--;
+        }
+    }
+
+    uint64_t lag(int subscriber) const
+    {
+        return nextSequence - cursors[subscriber];
+    }
+
+    uint64_t latestSequence() const
+    {
+        return nextSequence - 1;
+    }
+};
+
+// Layout of the shared-memory driver table. Slot i holds driver i + 1.
+// Each slot is guarded by a seqlock: the version is odd while the engine is
+// writing it, so readers retry until they see the same even version before
+// and after copying the fields.
+const uint32_t SHARED_DRIVER_MAGIC = 0x52534454; // "RSDT"
+const uint32_t SHARED_DRIVER_LAYOUT_VERSION = 1;
+
+struct SharedDriverSlot
+{
+    atomic<uint32_t> version;
+    int32_t driverId; // 0 while the slot is unused
+    uint8_t available;
+    double latitude;
+    double longitude;
+    int64_t lastActiveMs;
+};
+
+struct SharedDriverHeader
+{
+    uint32_t magic;
+    uint32_t layoutVersion;
+    uint32_t capacity;
+    atomic<uint32_t> slotCount; // slots that have ever been written
+};
+
+// Maps the driver table segment. The engine creates it read-write; other
+// local services open it read-only and copy slots out without any RPC.
+class SharedDriverTable
+{
+private:
+    SharedDriverHeader *header;
+    SharedDriverSlot *slots;
+    size_t mappedSize;
+    string ownedName; // segment to unlink on shutdown, if this table created it
+
+    static size_t segmentSize()
+    {
+        return sizeof(SharedDriverHeader) + sizeof(SharedDriverSlot) * SHARED_DRIVER_CAPACITY;
+    }
+
+public:
+    SharedDriverTable() : header(nullptr), slots(nullptr), mappedSize(0) {}
+
+    SharedDriverTable(const SharedDriverTable &) = delete;
+    SharedDriverTable &operator=(const SharedDriverTable &) = delete;
+
+    ~SharedDriverTable()
+    {
+#ifndef _WIN32
+        if (header != nullptr)
+        {
+            munmap(header, mappedSize);
+        }
+        if (!ownedName.empty())
+        {
+            shm_unlink(ownedName.c_str());
+        }
+#endif
+    }
+
+    bool isOpen() const
+    {
+        return header != nullptr;
+    }
+
+    // Creates a fresh segment for publishing. A segment left under the name
+    // is unlinked rather than reset, so readers still mapping it never see
+    // it cleared under them; new readers wait for the magic, stored last.
+    bool create(const char *name)
+    {
+#ifndef _WIN32
+        shm_unlink(name);
+        int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+        if (fd < 0)
+        {
+            return false;
+        }
+        mappedSize = segmentSize();
+        if (ftruncate(fd, mappedSize) != 0) // the new segment reads as zeros
+        {
+            close(fd);
+            shm_unlink(name);
+            return false;
+        }
+        void *memory = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (memory == MAP_FAILED)
+        {
+            shm_unlink(name);
+            return false;
+        }
+
+        ownedName = name;
+        header = static_cast<SharedDriverHeader *>(memory);
+        slots = reinterpret_cast<SharedDriverSlot *>(header + 1);
+        header->capacity = SHARED_DRIVER_CAPACITY;
+        header->layoutVersion = SHARED_DRIVER_LAYOUT_VERSION;
+        atomic_thread_fence(memory_order_release);
+        header->magic = SHARED_DRIVER_MAGIC;
+        return true;
+#else
+        (void)name;
+        return false;
+#endif
+    }
+
+    // Maps an existing segment for reading
+    bool openReadOnly(const char *name)
+    {
+#ifndef _WIN32
+        int fd = shm_open(name, O_RDONLY, 0);
+        if (fd < 0)
+        {
+            return false;
+        }
+        mappedSize = segmentSize();
+        void *memory = mmap(nullptr, mappedSize, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (memory == MAP_FAILED)
+        {
+            return false;
+        }
+
+        header = static_cast<SharedDriverHeader *>(memory);
+        slots = reinterpret_cast<SharedDriverSlot *>(header + 1);
+        if (header->magic != SHARED_DRIVER_MAGIC || header->layoutVersion != SHARED_DRIVER_LAYOUT_VERSION)
+        {
+            munmap(memory, mappedSize);
+            header = nullptr;
+            slots = nullptr;
+            return false;
+        }
+        atomic_thread_fence(memory_order_acquire);
+        return true;
+#else
+        (void)name;
+        return false;
+#endif
+    }
+
+    void publish(const Driver &driver)
+    {
+        int slotIndex = driver.id - 1;
+        if (header == nullptr || slotIndex < 0 || slotIndex >= SHARED_DRIVER_CAPACITY)
+        {
+            return;
+        }
+
+        SharedDriverSlot &slot = slots[slotIndex];
+        uint32_t version = slot.version.load(memory_order_relaxed);
+        slot.version.store(version + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+
+        slot.driverId = driver.id;
+        slot.available = driver.available ? 1 : 0;
+        slot.latitude = driver.location.latitude;
+        slot.longitude = driver.location.longitude;
+        slot.lastActiveMs = chrono::duration_cast<chrono::milliseconds>(
+                                driver.lastActive.time_since_epoch())
+                                .count();
+
+        slot.version.store(version + 2, memory_order_release);
+        if ((uint32_t)slotIndex >= header->slotCount.load(memory_order_relaxed))
+        {
+            header->slotCount.store(slotIndex + 1, memory_order_release);
+        }
+    }
+
+    uint32_t slotCount() const
+    {
+        return header == nullptr ? 0 : header->slotCount.load(memory_order_acquire);
+    }
+
+    // Copies a consistent snapshot of one slot; false if it is unused or
+    // no consistent copy was seen within SHARED_READ_RETRIES attempts
+    bool read(uint32_t slotIndex, SharedDriverSlot &out) const
+    {
+        if (header == nullptr || slotIndex >= SHARED_DRIVER_CAPACITY)
+        {
+            return false;
+        }
+
+        const SharedDriverSlot &slot = slots[slotIndex];
+        for (int attempt = 0; attempt < SHARED_READ_RETRIES; attempt++)
+        {
+            uint32_t before = slot.version.load(memory_order_acquire);
+            if (before & 1)
+            {
+                this_thread::yield(); // writer in progress
+                continue;
+            }
+
+            out.driverId = slot.driverId;
+            out.available = slot.available;
+            out.latitude = slot.latitude;
+            out.longitude = slot.longitude;
+            out.lastActiveMs = slot.lastActiveMs;
+
+            atomic_thread_fence(memory_order_acquire);
+            if (slot.version.load(memory_order_relaxed) == before)
+            {
+                return out.driverId != 0;
+            }
+        }
+        return false;
+    }
+};
+
+const char FROZEN_INDEX_MAGIC[8] = {'R', 'S', 'F', 'R', 'Z', 'N', '0', '1'};
+
+struct FrozenIndexHeader
+{
+    char magic[8];
+    uint64_t sequence; // last engine event reflected in the snapshot
+    uint32_t count;
+    uint32_t reserved;
+};
+
+// Read-only spatial index for snapshots. Drivers are sorted by geohash and
+// the cell keys are stored in Eytzinger (BFS) order, so a search walks
+// implicit children 2k and 2k+1 through one contiguous array instead of
+// chasing TrieNode pointers, and the top levels stay in cache. A prefix is
+// a key range, found with two searches.
+//
+// The layout is position-independent: header, latitudes, longitudes, then
+// keys and sorted ranks in Eytzinger order (slot 0 unused), then driver IDs.
+// A snapshot file is the same bytes, so loading it is a single mmap.
+class FrozenSpatialIndex
+{
+private:
+    vector<uint64_t> owned; // backing store when not mapped
+    void *mapping;
+    size_t mappedSize;
+
+    const FrozenIndexHeader *header;
+    const double *latitudes;
+    const double *longitudes;
+    const uint32_t *keys;
+    const uint32_t *ranks;
+    const int32_t *ids;
+
+    static size_t layoutSize(uint32_t count)
+    {
+        return sizeof(FrozenIndexHeader) + 2 * sizeof(double) * count + 2 * sizeof(uint32_t) * (count + 1) +
+               sizeof(int32_t) * count;
+    }
+
+    // Points the arrays into a buffer laid out as above
+    void attach(const void *base)
+    {
+        header = static_cast<const FrozenIndexHeader *>(base);
+        uint32_t count = header->count;
+        latitudes = reinterpret_cast<const double *>(header + 1);
+        longitudes = latitudes + count;
+        keys = reinterpret_cast<const uint32_t *>(longitudes + count);
+        ranks = keys + count + 1;
+        ids = reinterpret_cast<const int32_t *>(ranks + count + 1);
+    }
+
+    // Geohash cell as a number; ordering matches string ordering
+    static uint32_t cellKey(const string &geohash, int length)
+    {
+        uint32_t key = 0;
+        for (int i = 0; i < length; i++)
+        {
+            key = (key << 5) | Geohash::charIndex(geohash[i]);
+        }
+        return key;
+    }
+
+    // Sorted position of the first key not less than key
+    uint32_t lowerBound(uint32_t key) const
+    {
+        uint32_t count = header->count;
+        size_t k = 1;
+        while (k <= count)
+        {
+            k = 2 * k + (keys[k] < key);
+        }
+        // Undo the final run of right turns to reach the answer's slot
+        k >>= __builtin_ffsll(~k);
+        return k == 0 ? count : ranks[k];
+    }
+
+    static void fillEytzinger(const vector<uint32_t> &sorted, uint32_t *keys, uint32_t *ranks, size_t k, size_t &next)
+    {
+        if (k > sorted.size())
+        {
+            return;
+        }
+        fillEytzinger(sorted, keys, ranks, 2 * k, next);
+        keys[k] = sorted[next];
+        ranks[k] = next++;
+        fillEytzinger(sorted, keys, ranks, 2 * k + 1, next);
+    }
+
+public:
+    struct Entry
+    {
+        int driverId;
+        double latitude;
+        double longitude;
+    };
+
+    FrozenSpatialIndex() : mapping(nullptr), mappedSize(0), header(nullptr) {}
+
+    FrozenSpatialIndex(const FrozenSpatialIndex &) = delete;
+    FrozenSpatialIndex &operator=(const FrozenSpatialIndex &) = delete;
+
+    ~FrozenSpatialIndex()
+    {
+        unload();
+    }
+
+    void unload()
+    {
+#ifndef _WIN32
+        if (mapping != nullptr)
+        {
+            munmap(mapping, mappedSize);
+        }
+#endif
+        mapping = nullptr;
+        mappedSize = 0;
+        header = nullptr;
+        owned.clear();
+    }
+
+    bool isLoaded() const
+    {
+        return header != nullptr;
+    }
+
+    uint64_t sequence() const
+    {
+        return header == nullptr ? 0 : header->sequence;
+    }
+
+    size_t size() const
+    {
+        return header == nullptr ? 0 : header->count;
+    }
+
+    void build(vector<Entry> entries, uint64_t sequence)
+    {
+        vector<pair<uint32_t, size_t>> order;
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            string geohash = Geohash::encode(entries[i].latitude, entries[i].longitude);
+            order.push_back({cellKey(geohash, GEOHASH_PRECISION), i});
+        }
+        sort(order.begin(), order.end());
+
+        uint32_t count = entries.size();
+        owned.assign((layoutSize(count) + sizeof(uint64_t) - 1) / sizeof(uint64_t), 0);
+        FrozenIndexHeader *writable = reinterpret_cast<FrozenIndexHeader *>(owned.data());
+        memcpy(writable->magic, FROZEN_INDEX_MAGIC, sizeof(writable->magic));
+        writable->sequence = sequence;
+        writable->count = count;
+        attach(writable);
+
+        vector<uint32_t> sortedKeys;
+        for (uint32_t rank = 0; rank < count; rank++)
+        {
+            const Entry &entry = entries[order[rank].second];
+            sortedKeys.push_back(order[rank].first);
+            const_cast<double *>(latitudes)[rank] = entry.latitude;
+            const_cast<double *>(longitudes)[rank] = entry.longitude;
+            const_cast<int32_t *>(ids)[rank] = entry.driverId;
+        }
+        size_t next = 0;
+        fillEytzinger(sortedKeys, const_cast<uint32_t *>(keys), const_cast<uint32_t *>(ranks), 1, next);
+    }
+
+    bool save(const string &path) const
+    {
+        if (header == nullptr)
+        {
+            return false;
+        }
+        ofstream out(path, ios::binary | ios::trunc);
+        out.write(reinterpret_cast<const char *>(header), layoutSize(header->count));
+        return (bool)out;
+    }
+
+    // Maps a snapshot file read-only (or reads it where mmap is unavailable)
+    bool load(const string &path)
+    {
+        error_code error;
+        size_t fileSize = filesystem::file_size(path, error);
+        if (error || fileSize < sizeof(FrozenIndexHeader))
+        {
+            return false;
+        }
+
+#ifndef _WIN32
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+        void *memory = mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (memory == MAP_FAILED)
+        {
+            return false;
+        }
+        const void *base = memory;
+#else
+        owned.assign((fileSize + sizeof(uint64_t) - 1) / sizeof(uint64_t), 0);
+        ifstream in(path, ios::binary);
+        in.read(reinterpret_cast<char *>(owned.data()), fileSize);
+        const void *base = owned.data();
+#endif
+
+        const FrozenIndexHeader *candidate = static_cast<const FrozenIndexHeader *>(base);
+        if (memcmp(candidate->magic, FROZEN_INDEX_MAGIC, sizeof(candidate->magic)) != 0 ||
+            layoutSize(candidate->count) != fileSize)
+        {
+#ifndef _WIN32
+            munmap(memory, fileSize);
+#endif
+            return false;
+        }
+
+#ifndef _WIN32
+        mapping = memory;
+        mappedSize = fileSize;
+#endif
+        attach(base);
+        return true;
+    }
+
+    // Calls visit(driverId, latitude, longitude) for every driver whose
+    // geohash starts with prefix
+    template <typename Visit>
+    void forEachWithPrefix(const string &prefix, Visit visit) const
+    {
+        if (header == nullptr || prefix.length() > GEOHASH_PRECISION)
+        {
+            return;
+        }
+        int shift = 5 * (GEOHASH_PRECISION - prefix.length());
+        uint32_t low = cellKey(prefix, prefix.length()) << shift;
+        uint32_t end = lowerBound(low + (1u << shift));
+        for (uint32_t rank = lowerBound(low); rank < end; rank++)
+        {
+            visit(ids[rank], latitudes[rank], longitudes[rank]);
+        }
+    }
+};
+
+// Predicted dropoff location and time of drivers on a trip, kept current
+// from trip progress updates
+class DropoffIndex
+{
+private:
+    struct Dropoff
+    {
+        string geohash;
+        Location location;
+        chrono::system_clock::time_point expectedAt;
+    };
+
+    shared_ptr<TrieNode> root; // shared with forked engines, copied on write
+    unordered_map<int, Dropoff> dropoffs;
+
+public:
+    DropoffIndex() : root(make_shared<TrieNode>()) {}
+
+    void update(int driverId, double latitude, double longitude, long long secondsRemaining)
+    {
+        remove(driverId);
+        string geohash = Geohash::encode(latitude, longitude);
+        TrieNode::detach(root);
+        root->insertDriver(geohash, driverId);
+        dropoffs.emplace(driverId, Dropoff{geohash, Location(latitude, longitude),
+                                           chrono::system_clock::now() + chrono::seconds(secondsRemaining)});
+    }
+
+    void remove(int driverId)
+    {
+        auto it = dropoffs.find(driverId);
+        if (it == dropoffs.end())
+        {
+            return;
+        }
+        TrieNode::detach(root);
+        root->removeDriver(it->second.geohash, driverId);
+        dropoffs.erase(it);
+    }
+
+    size_t size() const
+    {
+        return dropoffs.size();
+    }
+
+    // Pickup distance plus the distance a driver covers in the remaining
+    // trip time, for ranking drivers finishing a trip against idle ones
+    static double etaDistance(double pickupKm, long long secondsRemaining)
+    {
+        return pickupKm + secondsRemaining * PICKUP_SPEED_KMH / 3600.0;
+    }
+
+    // Calls visit(driverId, dropoff, secondsRemaining) for drivers dropping
+    // off soon in the PREDICTED_DROPOFF_PRECISION cells around geohash.
+    // Drivers past their expected dropoff time are dropped from the index:
+    // their prediction is no longer worth anything.
+    template <typename Visit>
+    void forEachNear(const string &geohash, Visit visit)
+    {
+        if (dropoffs.empty())
+        {
+            return;
+        }
+        auto now = chrono::system_clock::now();
+        vector<int> overdue;
+        for (const auto &cell : Geohash::adjacentCells(geohash.substr(0, PREDICTED_DROPOFF_PRECISION)))
+        {
+            for (int driverId : root->findDriversWithPrefix(cell))
+            {
+                const Dropoff &dropoff = dropoffs.at(driverId);
+                if (dropoff.expectedAt < now)
+                {
+                    overdue.push_back(driverId);
+                    continue;
+                }
+                long long secondsRemaining = chrono::duration_cast<chrono::seconds>(dropoff.expectedAt - now).count();
+                if (secondsRemaining <= PREDICTED_MAX_REMAINING_S)
+                {
+                    visit(driverId, dropoff.location, secondsRemaining);
+                }
+            }
+        }
+        for (int driverId : overdue)
+        {
+            remove(driverId);
+        }
+    }
+};
+
+// Structure for driver-passenger matching
+struct DriverMatch
+{
+    int driverId;
+    double distance; // ranking key; for a driver finishing a trip, includes the remaining trip
+    double pickupDistance; // from the driver (or their dropoff) to the pickup
+    chrono::system_clock::time_point lastActive;
+    bool finishingTrip;
+
+    DriverMatch(int id, double dist, chrono::system_clock::time_point time)
+        : driverId(id), distance(dist), pickupDistance(dist), lastActive(time), finishingTrip(false) {}
+
+    DriverMatch(int id, double pickupKm, long long secondsRemaining, chrono::system_clock::time_point time)
+        : driverId(id), distance(DropoffIndex::etaDistance(pickupKm, secondsRemaining)), pickupDistance(pickupKm),
+          lastActive(time), finishingTrip(true) {}
+
+    // For min-heap based on distance
+    bool operator>(const DriverMatch &other) const
+    {
+        if (abs(distance - other.distance) < 0.001)
+        {
+            // If distances are very close, prioritize by wait time
+            return lastActive > other.lastActive;
+        }
+        return distance > other.distance;
+    }
+};
+
+// Dense copy of every driver's matching inputs, stored column by column so
+// a whole-fleet scan is a branch-free pass over contiguous arrays that the
+// compiler vectorizes. Available drivers are kept in the leading rows, so a
+// scan only touches drivers that can be matched. Also keeps per-cell driver
+// counts, which the matcher uses to estimate what an index search would cost.
+class DriverHotTable
+{
+private:
+    vector<int> ids;
+    vector<int> cells; // MATCH_CELL_PRECISION prefix code the trie files the driver under
+    vector<unsigned char> available;
+    vector<double> latitudes;
+    vector<double> longitudes;
+    vector<chrono::system_clock::time_point> lastActive;
+    unordered_map<int, size_t> slots; // driver ID to column position
+    size_t availableRows;             // rows [0, availableRows) are available
+
+    vector<int> cellDrivers;   // indexed drivers per cell
+    vector<int> cellAvailable; // of those, available
+
+    vector<unsigned char> mask; // scan scratch
+
+    void swapRows(size_t a, size_t b)
+    {
+        if (a == b)
+        {
+            return;
+        }
+        swap(ids[a], ids[b]);
+        swap(cells[a], cells[b]);
+        swap(available[a], available[b]);
+        swap(latitudes[a], latitudes[b]);
+        swap(longitudes[a], longitudes[b]);
+        swap(lastActive[a], lastActive[b]);
+        slots[ids[a]] = a;
+        slots[ids[b]] = b;
+    }
+
+public:
+    DriverHotTable() : availableRows(0), cellDrivers(cellCount(), 0), cellAvailable(cellCount(), 0) {}
+
+    static int cellCount()
+    {
+        return 1 << (5 * MATCH_CELL_PRECISION);
+    }
+
+    static int cellOf(const string &geohash)
+    {
+        int cell = 0;
+        for (int i = 0; i < MATCH_CELL_PRECISION; i++)
+        {
+            cell = (cell << 5) | Geohash::charIndex(geohash[i]);
+        }
+        return cell;
+    }
+
+    void upsert(const Driver &driver, const string &geohash)
+    {
+        int cell = cellOf(geohash);
+        auto it = slots.find(driver.id);
+        size_t slot;
+        if (it == slots.end())
+        {
+            slot = ids.size();
+            slots[driver.id] = slot;
+            ids.push_back(driver.id);
+            cells.push_back(cell);
+            available.push_back(0);
+            latitudes.push_back(0);
+            longitudes.push_back(0);
+            lastActive.push_back(driver.lastActive);
+        }
+        else
+        {
+            slot = it->second;
+            cellDrivers[cells[slot]]--;
+            cellAvailable[cells[slot]] -= available[slot];
+        }
+
+        // Keep the available rows leading: swap across the boundary
+        if (driver.available && !available[slot])
+        {
+            swapRows(slot, availableRows);
+            slot = availableRows++;
+        }
+        else if (!driver.available && available[slot])
+        {
+            swapRows(slot, --availableRows);
+            slot = availableRows;
+        }
+
+        cells[slot] = cell;
+        available[slot] = driver.available;
+        latitudes[slot] = driver.location.latitude;
+        longitudes[slot] = driver.location.longitude;
+        lastActive[slot] = driver.lastActive;
+        cellDrivers[cell]++;
+        cellAvailable[cell] += driver.available;
+    }
+
+    int size() const
+    {
+        return ids.size();
+    }
+
+    int availableSize() const
+    {
+        return availableRows;
+    }
+
+    // Calls visit(driverId, latitude, longitude) for every available driver
+    template <typename Visit>
+    void forEachAvailable(Visit visit) const
+    {
+        for (size_t i = 0; i < availableRows; i++)
+        {
+            visit(ids[i], latitudes[i], longitudes[i]);
+        }
+    }
+
+    int driversInCell(int cell) const
+    {
+        return cellDrivers[cell];
+    }
+
+    int availableInCell(int cell) const
+    {
+        return cellAvailable[cell];
+    }
+
+    // Calls visit(driverId, latitude, longitude, lastActive) for every
+    // available driver filed under one of targetCells
+    template <typename Visit>
+    void scanCells(const vector<int> &targetCells, Visit visit)
+    {
+        size_t count = availableRows;
+        mask.assign(count, 0);
+        const int *cellColumn = cells.data();
+        unsigned char *maskColumn = mask.data();
+        for (int cell : targetCells)
+        {
+            for (size_t i = 0; i < count; i++)
+            {
+                maskColumn[i] |= cellColumn[i] == cell;
+            }
+        }
+
+        for (size_t i = 0; i < count; i++)
+        {
+            if (maskColumn[i])
+            {
+                visit(ids[i], latitudes[i], longitudes[i], lastActive[i]);
+            }
+        }
+    }
+};
+
+// Filters for an operations query over the fleet
+struct FleetQuery
+{
+    string zone;             // geohash prefix, empty for everywhere
+    int vehicleClass;        // a VehicleClass, or -1 for any
+    int available;           // 1 available, 0 unavailable, -1 either
+    long long minIdleSeconds; // since last movement or becoming available
+};
+
+// Secondary indexes over driver status, vehicle class and idle time, kept
+// as bitsets so a query is a few word-wise ANDs instead of a pass over
+// every driver. Idle time changes without any event, so drivers are filed
+// by the bucket their last activity fell in: every bucket that ended before
+// a query's cutoff matches whole, and only the bucket containing the cutoff
+// is checked driver by driver.
+class FleetIndex
+{
+private:
+    struct IdleBucket
+    {
+        DriverBitset drivers;
+        int count;
+    };
+
+    struct Entry
+    {
+        int vehicleClass;
+        long long lastActiveSeconds;
+    };
+
+    DriverBitset allDrivers;
+    DriverBitset availableDrivers;
+    DriverBitset byVehicleClass[VEHICLE_CLASS_COUNT];
+    map<long long, IdleBucket> idleBuckets; // keyed by lastActiveSeconds / IDLE_BUCKET_SECONDS
+    unordered_map<int, Entry> entries;
+
+    static long long bucketOf(long long seconds)
+    {
+        return seconds / IDLE_BUCKET_SECONDS;
+    }
+
+public:
+    void update(const Driver &driver)
+    {
+        long long lastActiveSeconds = chrono::duration_cast<chrono::seconds>(driver.lastActive.time_since_epoch()).count();
+        auto it = entries.find(driver.id);
+        if (it != entries.end())
+        {
+            byVehicleClass[it->second.vehicleClass].set(driver.id, false);
+            auto bucket = idleBuckets.find(bucketOf(it->second.lastActiveSeconds));
+            bucket->second.drivers.set(driver.id, false);
+            if (--bucket->second.count == 0)
+            {
+                idleBuckets.erase(bucket);
+            }
+        }
+
+        entries[driver.id] = Entry{driver.vehicleClass, lastActiveSeconds};
+        allDrivers.set(driver.id, true);
+        availableDrivers.set(driver.id, driver.available);
+        byVehicleClass[driver.vehicleClass].set(driver.id, true);
+        IdleBucket &bucket = idleBuckets[bucketOf(lastActiveSeconds)];
+        bucket.drivers.set(driver.id, true);
+        bucket.count++;
+    }
+
+    const DriverBitset &available() const
+    {
+        return availableDrivers;
+    }
+
+    // Drivers matching every filter of the query except the zone
+    DriverBitset select(const FleetQuery &query, long long nowSeconds) const
+    {
+        DriverBitset result = allDrivers;
+        if (query.available == 1)
+        {
+            result.andWith(availableDrivers);
+        }
+        else if (query.available == 0)
+        {
+            result.andNot(availableDrivers);
+        }
+        if (query.vehicleClass >= 0 && query.vehicleClass < VEHICLE_CLASS_COUNT)
+        {
+            result.andWith(byVehicleClass[query.vehicleClass]);
+        }
+
+        if (query.minIdleSeconds > 0)
+        {
+            long long cutoff = nowSeconds - query.minIdleSeconds;
+            DriverBitset idle;
+            for (auto it = idleBuckets.begin(); it != idleBuckets.end() && it->first <= bucketOf(cutoff); ++it)
+            {
+                if (it->first < bucketOf(cutoff))
+                {
+                    idle.orWith(it->second.drivers);
+                    continue;
+                }
+                for (int driverId : it->second.drivers.toVector())
+                {
+                    if (entries.at(driverId).lastActiveSeconds <= cutoff)
+                    {
+                        idle.set(driverId, true);
+                    }
+                }
+            }
+            result.andWith(idle);
+        }
+        return result;
+    }
+};
+
+// Classes of dispatch work, listed in the order a tick serves them
+enum WorkClass
+{
+    WORK_MATCHING,    // queued ride requests
+    WORK_LOCATIONS,   // coalesced driver location updates
+    WORK_EXPIRY,      // expired ride request sweep
+    WORK_MAINTENANCE, // stats and index upkeep
+    WORK_CLASS_COUNT
+};
+
+// Runs each work class in priority order with its own time budget, so a flood
+// of low-priority work can never starve matching.
+class DispatchScheduler
+{
+private:
+    long long budgets[WORK_CLASS_COUNT];
+    long long processed[WORK_CLASS_COUNT];
+    long long budgetExhausted[WORK_CLASS_COUNT];
+    long long ticks;
+
+public:
+    DispatchScheduler() : ticks(0)
+    {
+        budgets[WORK_MATCHING] = TICK_BUDGET_MATCHING_US;
+        budgets[WORK_LOCATIONS] = TICK_BUDGET_LOCATIONS_US;
+        budgets[WORK_EXPIRY] = TICK_BUDGET_EXPIRY_US;
+        budgets[WORK_MAINTENANCE] = TICK_BUDGET_MAINTENANCE_US;
+        fill(processed, processed + WORK_CLASS_COUNT, 0);
+        fill(budgetExhausted, budgetExhausted + WORK_CLASS_COUNT, 0);
+    }
+
+    // step(workClass) performs one unit of work and returns false once that class is idle
+    template <typename Step>
+    void runTick(Step step)
+    {
+        ticks++;
+        for (int c = 0; c < WORK_CLASS_COUNT; c++)
+        {
+            auto deadline = chrono::steady_clock::now() + chrono::microseconds(budgets[c]);
+            while (true)
+            {
+                if (chrono::steady_clock::now() >= deadline)
+                {
+                    budgetExhausted[c]++;
+                    break;
+                }
+                if (!step((WorkClass)c))
+                {
+                    break;
+                }
+                processed[c]++;
+            }
+        }
+    }
+
+    static const char *className(int c)
+    {
+        switch (c)
+        {
+        case WORK_MATCHING:
+            return "matching";
+        case WORK_LOCATIONS:
+            return "locations";
+        case WORK_EXPIRY:
+            return "expiry";
+        default:
+            return "maintenance";
+        }
+    }
+
+    void display() const
+    {
+        cout << "Ticks run: " << ticks << endl;
+        for (int c = 0; c < WORK_CLASS_COUNT; c++)
+        {
+            cout << "  " << className(c) << ": " << processed[c] << " processed, budget exhausted "
+                 << budgetExhausted[c] << " times" << endl;
+        }
+    }
+};
+
+// Counters exported as Prometheus metrics
+enum MetricCounter
+{
+    METRIC_MATCHES,
+    METRIC_FAILED_MATCHES,
+    METRIC_EXPIRATIONS,
+    METRIC_CELL_TRANSITIONS,
+    METRIC_LOCATION_UPDATES,
+    METRIC_INDEX_SEARCHES, // matches that walked the trie
+    METRIC_SCAN_SEARCHES,  // matches that scanned the hot driver table
+    METRIC_DEADLINE_MATCHES, // matches cut short by their search budget
+    METRIC_EXPORT_DROPPED,   // events dropped because the exporter fell behind
+    METRIC_CHANGES_LOST,     // change events a subscriber fell too far behind to read
+    METRIC_COUNTER_COUNT
+};
+
+// Gauges exported as Prometheus metrics
+enum MetricGauge
+{
+    METRIC_PENDING_REQUESTS,
+    METRIC_QUEUED_RIDE_REQUESTS,
+    METRIC_QUEUED_LOCATION_UPDATES,
+    METRIC_DRIVERS,
+    METRIC_ADMISSION_STATE,
+    METRIC_GAUGE_COUNT
+};
+
+// Latency histograms exported as Prometheus metrics
+enum MetricHistogram
+{
+    METRIC_MATCH_CANDIDATES_LATENCY, // gathering candidate drivers
+    METRIC_MATCH_LATENCY,            // whole matchRideRequest
+    METRIC_LOCATION_UPDATE_LATENCY,
+    METRIC_TICK_LATENCY,
+    METRIC_HISTOGRAM_COUNT
+};
+
+// Histogram bucket upper bounds in microseconds (+Inf is implicit)
+const long long LATENCY_BUCKETS_US[] = {50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000};
+const int LATENCY_BUCKET_COUNT = sizeof(LATENCY_BUCKETS_US) / sizeof(LATENCY_BUCKETS_US[0]);
+
+// Counters and histograms are split into per-thread shards of relaxed
+// atomics, so recording never contends and rendering just sums the shards
+// without stopping writers.
+class MetricsRegistry
+{
+private:
+    struct alignas(64) Shard
+    {
+        atomic<long long> counters[METRIC_COUNTER_COUNT];
+        atomic<long long> buckets[METRIC_HISTOGRAM_COUNT][LATENCY_BUCKET_COUNT + 1];
+        atomic<long long> sums[METRIC_HISTOGRAM_COUNT];
+    };
+
+    unique_ptr<Shard[]> shards;
+    atomic<long long> gauges[METRIC_GAUGE_COUNT];
+
+    static int threadShard()
+    {
+        static atomic<int> nextShard(0);
+        thread_local int shard = nextShard.fetch_add(1) % METRIC_SHARDS;
+        return shard;
+    }
+
+    static const char *counterName(int c)
+    {
+        static const char *names[] = {"ride_matches_total", "ride_failed_matches_total",
+                                      "ride_expirations_total", "ride_cell_transitions_total",
+                                      "ride_location_updates_total", "ride_index_searches_total",
+                                      "ride_scan_searches_total", "ride_deadline_matches_total",
+                                      "ride_export_dropped_total", "ride_change_events_lost_total"};
+        return names[c];
+    }
+
+    static const char *gaugeName(int g)
+    {
+        static const char *names[] = {"ride_pending_requests", "ride_queued_ride_requests",
+                                      "ride_queued_location_updates", "ride_drivers",
+                                      "ride_admission_state"};
+        return names[g];
+    }
+
+    static const char *histogramName(int h)
+    {
+        static const char *names[] = {"ride_match_candidates_latency_us", "ride_match_latency_us",
+                                      "ride_location_update_latency_us", "ride_tick_latency_us"};
+        return names[h];
+    }
+
+    long long sumCounter(int c) const
+    {
+        long long total = 0;
+        for (int i = 0; i < METRIC_SHARDS; i++)
+        {
+            total += shards[i].counters[c].load(memory_order_relaxed);
+        }
+        return total;
+    }
+
+public:
+    MetricsRegistry() : shards(new Shard[METRIC_SHARDS])
+    {
+        for (int i = 0; i < METRIC_SHARDS; i++)
+        {
+            for (auto &counter : shards[i].counters)
+            {
+                counter.store(0);
+            }
+            for (auto &histogram : shards[i].buckets)
+            {
+                for (auto &bucket : histogram)
+                {
+                    bucket.store(0);
+                }
+            }
+            for (auto &sum : shards[i].sums)
+            {
+                sum.store(0);
+            }
+        }
+        for (auto &gauge : gauges)
+        {
+            gauge.store(0);
+        }
+    }
+
+    void increment(MetricCounter counter, long long by = 1)
+    {
+        shards[threadShard()].counters[counter].fetch_add(by, memory_order_relaxed);
+    }
+
+    void setGauge(MetricGauge gauge, long long value)
+    {
+        gauges[gauge].store(value, memory_order_relaxed);
+    }
+
+    void observe(MetricHistogram histogram, long long micros)
+    {
+        int bucket = lower_bound(LATENCY_BUCKETS_US, LATENCY_BUCKETS_US + LATENCY_BUCKET_COUNT, micros) - LATENCY_BUCKETS_US;
+        Shard &shard = shards[threadShard()];
+        shard.buckets[histogram][bucket].fetch_add(1, memory_order_relaxed);
+        shard.sums[histogram].fetch_add(micros, memory_order_relaxed);
+    }
+
+    long long counterValue(MetricCounter counter) const
+    {
+        return sumCounter(counter);
+    }
+
+    // Prometheus text exposition format
+    string render() const
+    {
+        ostringstream out;
+        for (int c = 0; c < METRIC_COUNTER_COUNT; c++)
+        {
+            out << "# TYPE " << counterName(c) << " counter\n"
+                << counterName(c) << ' ' << sumCounter(c) << '\n';
+        }
+        for (int g = 0; g < METRIC_GAUGE_COUNT; g++)
+        {
+            out << "# TYPE " << gaugeName(g) << " gauge\n"
+                << gaugeName(g) << ' ' << gauges[g].load(memory_order_relaxed) << '\n';
+        }
+        for (int h = 0; h < METRIC_HISTOGRAM_COUNT; h++)
+        {
+            long long cumulative = 0, sum = 0;
+            out << "# TYPE " << histogramName(h) << " histogram\n";
+            for (int b = 0; b <= LATENCY_BUCKET_COUNT; b++)
+            {
+                for (int i = 0; i < METRIC_SHARDS; i++)
+                {
+                    cumulative += shards[i].buckets[h][b].load(memory_order_relaxed);
+                }
+                out << histogramName(h) << "_bucket{le=\"";
+                if (b < LATENCY_BUCKET_COUNT)
+                {
+                    out << LATENCY_BUCKETS_US[b];
+                }
+                else
+                {
+                    out << "+Inf";
+                }
+                out << "\"} " << cumulative << '\n';
+            }
+            for (int i = 0; i < METRIC_SHARDS; i++)
+            {
+                sum += shards[i].sums[h].load(memory_order_relaxed);
+            }
+            out << histogramName(h) << "_sum " << sum << '\n'
+                << histogramName(h) << "_count " << cumulative << '\n';
+        }
+        out << LockSiteRegistry::instance().render();
+        return out.str();
+    }
+};
+
+// Minimal HTTP server on 127.0.0.1 that answers every request with the
+// rendered metrics. Runs on its own thread so scrapes never touch dispatch.
+class MetricsServer
+{
+private:
+    const MetricsRegistry &registry;
+    atomic<bool> running;
+    thread worker;
+    int listenFd;
+
+    void serve()
+    {
+#ifndef _WIN32
+        while (running.load())
+        {
+            pollfd pending{listenFd, POLLIN, 0};
+            if (poll(&pending, 1, 200) <= 0)
+            {
+                continue; // wake up periodically to notice stop()
+            }
+
+            int client = accept(listenFd, nullptr, nullptr);
+            if (client < 0)
+            {
+                continue;
+            }
+
+            // A stalled client must not hold up the server or stop()
+            timeval timeout{METRICS_CLIENT_TIMEOUT_MS / 1000, (METRICS_CLIENT_TIMEOUT_MS % 1000) * 1000};
+            setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+            char request[1024];
+            if (recv(client, request, sizeof(request), 0) > 0)
+            {
+                string body = registry.render();
+                string response = "HTTP/1.1 200 OK\r\n"
+                                  "Content-Type: text/plain; version=0.0.4\r\n"
+                                  "Content-Length: " +
+                                  to_string(body.size()) + "\r\n"
+                                                           "Connection: close\r\n\r\n" +
+                                  body;
+                send(client, response.data(), response.size(), 0);
+            }
+            close(client);
+        }
+#endif
+    }
+
+public:
+    MetricsServer(const MetricsRegistry &registry) : registry(registry), running(false), listenFd(-1) {}
+
+    ~MetricsServer()
+    {
+        stop();
+    }
+
+    bool start(int port)
+    {
+#ifndef _WIN32
+        listenFd = socket(AF_INET, SOCK_STREAM, 0);
+        if (listenFd < 0)
+        {
+            return false;
+        }
+        int reuse = 1;
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(listenFd, (sockaddr *)&address, sizeof(address)) != 0 || listen(listenFd, 16) != 0)
+        {
+            close(listenFd);
+            listenFd = -1;
+            return false;
+        }
+
+        running.store(true);
+        worker = thread(&MetricsServer::serve, this);
+        return true;
+#else
+        (void)port;
+        return false;
+#endif
+    }
+
+    void stop()
+    {
+        if (!running.exchange(false))
+        {
+            return;
+        }
+        worker.join();
+#ifndef _WIN32
+        close(listenFd);
+#endif
+        listenFd = -1;
+    }
+};
+
+// Everything needed to understand one matchRideRequest call after the fact
+struct MatchTrace
+{
+    struct Candidate
+    {
+        int driverId;
+        double latitude;
+        double longitude;
+        double distance;
+    };
+
+    int passengerId;
+    double latitude;
+    double longitude;
+    string geohash;
+    long long timestampMs;
+    int cellsScanned;
+    int candidatesFound;     // available driver IDs returned by the index
+    int availableCandidates; // of those, available drivers
+    int matchedDriverId;     // 0 if no match
+    bool scanned;            // candidates came from the linear scan, not the trie
+    bool deadlineHit;        // search stopped when its budget ran out
+    long long encodeUs;
+    long long candidatesUs;
+    long long selectUs;
+    long long totalUs;
+    vector<Candidate> candidates; // nearest first, up to SLOW_MATCH_CANDIDATES
+};
+
+// Bounded ring of the most recent slow matches
+class SlowMatchLog
+{
+private:
+    vector<MatchTrace> traces;
+    size_t next;
+    long long captured;
+
+public:
+    SlowMatchLog() : next(0), captured(0) {}
+
+    void capture(MatchTrace trace)
+    {
+        if (traces.size() < SLOW_MATCH_CAPACITY)
+        {
+            traces.push_back(move(trace));
+        }
+        else
+        {
+            traces[next] = move(trace);
+        }
+        next = (next + 1) % SLOW_MATCH_CAPACITY;
+        captured++;
+    }
+
+    void dump() const
+    {
+        cout << "\n--- Slow Matches (over " << SLOW_MATCH_THRESHOLD_US << " us, "
+             << captured << " captured) ---" << endl;
+
+        // Oldest first
+        size_t start = traces.size() < SLOW_MATCH_CAPACITY ? 0 : next;
+        for (size_t i = 0; i < traces.size(); i++)
+        {
+            const MatchTrace &trace = traces[(start + i) % traces.size()];
+            cout << "Request #" << trace.passengerId << " at (" << fixed << setprecision(6)
+                 << trace.latitude << ", " << trace.longitude << ") geohash " << trace.geohash
+                 << " at " << trace.timestampMs << " ms" << endl;
+            cout << "  total " << trace.totalUs << " us: encode " << trace.encodeUs
+                 << " us, candidates " << trace.candidatesUs << " us, select " << trace.selectUs << " us" << endl;
+            cout << "  cells scanned " << trace.cellsScanned << ", candidates " << trace.candidatesFound
+                 << ", available " << trace.availableCandidates << ", matched driver #"
+                 << trace.matchedDriverId << (trace.scanned ? " (scan)" : " (index)")
+                 << (trace.deadlineHit ? ", budget spent" : "") << endl;
+            for (const auto &candidate : trace.candidates)
+            {
+                cout << "    driver #" << candidate.driverId << " at (" << setprecision(6) << candidate.latitude << ", "
+                     << candidate.longitude << ") " << setprecision(3) << candidate.distance << " km" << endl;
+            }
+        }
+        cout << "-------------------------------------------------------\n"
+             << endl;
+    }
+};
+
+// Read-only copy of one candidate driver as the primary matcher saw it
+struct ShadowCandidate
+{
+    int driverId;
+    double latitude;
+    double longitude;
+    long long lastActiveMs;
+    long long secondsRemaining; // of the current trip, for a driver finishing one
+};
+
+// One request as decided by the primary matcher, replayed by the shadow
+struct ShadowJob
+{
+    int passengerId;
+    double latitude;
+    double longitude;
+    vector<ShadowCandidate> candidates;
+    unordered_set<int> candidateIds; // dedups candidates while snapshotting
+    int primaryDriverId; // 0 if the primary found no driver
+    double primaryDistance;
+    long long primaryLatencyUs;
+};
+
+// Primary and shadow decisions for one request side by side
+struct ShadowResult
+{
+    int passengerId;
+    int primaryDriverId;
+    int shadowDriverId;
+    double primaryDistance;
+    double shadowDistance;
+    long long primaryLatencyUs;
+    long long shadowLatencyUs;
+};
+
+// Policy under evaluation: picks a driver ID (0 for none) for a pickup
+using ShadowPolicy = function<int(const Location &, const vector<ShadowCandidate> &)>;
+
+// Replays every primary match decision through an alternative policy on a
+// separate thread, using the candidate snapshot the primary saw, and
+// records both choices and their costs. The dispatch thread only hands off
+// the job; if the shadow falls behind, jobs are dropped rather than queued.
+class ShadowMatcher
+{
+private:
+    ShadowPolicy policy;
+    InstrumentedMutex lock;
+    condition_variable_any jobReady;
+    deque<ShadowJob> jobs; // guarded by lock
+    bool stopping;         // guarded by lock
+
+    // Guarded by lock
+    vector<ShadowResult> results;
+    size_t nextResult;
+    long long compared;
+    long long agreed;
+    long long dropped;
+    long long bothMatched; // requests where both policies found a driver
+    double primaryKm;      // pickup distances summed over bothMatched only
+    double shadowKm;
+    long long primaryUs;
+    long long shadowUs;
+
+    thread worker;
+
+    void run()
+    {
+        while (true)
+        {
+            ShadowJob job;
+            {
+                unique_lock<InstrumentedMutex> guard(lock);
+                jobReady.wait(guard, [this]
+                              { return stopping || !jobs.empty(); });
+                if (jobs.empty())
+                {
+                    break; // stopping
+                }
+                job = move(jobs.front());
+                jobs.pop_front();
+            }
+
+            Location pickup(job.latitude, job.longitude);
+            auto startTime = chrono::steady_clock::now();
+            int shadowDriverId = policy(pickup, job.candidates);
+            long long shadowLatency = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - startTime).count();
+
+            double shadowDistance = 0;
+            for (const auto &candidate : job.candidates)
+            {
+                if (candidate.driverId == shadowDriverId)
+                {
+                    shadowDistance = pickup.distanceTo(Location(candidate.latitude, candidate.longitude));
+                }
+            }
+
+            ShadowResult result{job.passengerId, job.primaryDriverId, shadowDriverId, job.primaryDistance,
+                                shadowDistance, job.primaryLatencyUs, shadowLatency};
+
+            lock_guard<InstrumentedMutex> guard(lock);
+            if (results.size() < SHADOW_RESULT_CAPACITY)
+            {
+                results.push_back(result);
+            }
+            else
+            {
+                results[nextResult] = result;
+            }
+            nextResult = (nextResult + 1) % SHADOW_RESULT_CAPACITY;
+            compared++;
+            agreed += shadowDriverId == job.primaryDriverId;
+            if (job.primaryDriverId != 0 && shadowDriverId != 0)
+            {
+                bothMatched++;
+                primaryKm += job.primaryDistance;
+                shadowKm += shadowDistance;
+            }
+            primaryUs += job.primaryLatencyUs;
+            shadowUs += shadowLatency;
+        }
+    }
+
+public:
+    ShadowMatcher(ShadowPolicy policy)
+        : policy(policy), lock("shadow_matcher"), stopping(false), nextResult(0), compared(0), agreed(0),
+          dropped(0), bothMatched(0), primaryKm(0), shadowKm(0), primaryUs(0), shadowUs(0)
+    {
+        worker = thread(&ShadowMatcher::run, this);
+    }
+
+    ~ShadowMatcher()
+    {
+        {
+            lock_guard<InstrumentedMutex> guard(lock);
+            stopping = true;
+        }
+        jobReady.notify_one();
+        worker.join();
+    }
+
+    void submit(ShadowJob job)
+    {
+        {
+            lock_guard<InstrumentedMutex> guard(lock);
+            if (jobs.size() >= SHADOW_QUEUE_CAPACITY)
+            {
+                dropped++;
+                return;
+            }
+            jobs.push_back(move(job));
+        }
+        jobReady.notify_one();
+    }
+
+    // Default alternative: the longest-idle driver among those nearly as
+    // close as the nearest one, with drivers finishing a trip ranked by ETA
+    static int longestIdleNearby(const Location &pickup, const vector<ShadowCandidate> &candidates)
+    {
+        auto etaDistance = [&](const ShadowCandidate &candidate)
+        {
+            return DropoffIndex::etaDistance(pickup.distanceTo(Location(candidate.latitude, candidate.longitude)),
+                                             candidate.secondsRemaining);
+        };
+
+        double nearest = -1;
+        for (const auto &candidate : candidates)
+        {
+            double distance = etaDistance(candidate);
+            if (nearest < 0 || distance < nearest)
+            {
+                nearest = distance;
+            }
+        }
+
+        int chosen = 0;
+        long long oldestActive = 0;
+        for (const auto &candidate : candidates)
+        {
+            double distance = etaDistance(candidate);
+            if (distance <= nearest * SHADOW_IDLE_DISTANCE_SLACK &&
+                (chosen == 0 || candidate.lastActiveMs < oldestActive))
+            {
+                chosen = candidate.driverId;
+                oldestActive = candidate.lastActiveMs;
+            }
+        }
+        return chosen;
+    }
+
+    void display()
+    {
+        lock_guard<InstrumentedMutex> guard(lock);
+        cout << "\n--- Shadow Matcher ---" << endl;
+        cout << "Compared: " << compared << ", agreed: " << agreed << ", dropped: " << dropped
+             << ", queued: " << jobs.size() << endl;
+        if (bothMatched > 0)
+        {
+            cout << fixed << setprecision(3)
+                 << "Average pickup (" << bothMatched << " requests both matched): primary "
+                 << primaryKm / bothMatched << " km, shadow " << shadowKm / bothMatched << " km" << endl;
+        }
+        if (compared > 0)
+        {
+            cout << fixed << setprecision(3)
+                 << "Average latency: primary " << primaryUs / compared << " us, shadow "
+                 << shadowUs / compared << " us" << endl;
+        }
+
+        size_t start = results.size() < SHADOW_RESULT_CAPACITY ? 0 : nextResult;
+        size_t shown = min(results.size(), (size_t)10);
+        for (size_t i = results.size() - shown; i < results.size(); i++)
+        {
+            const ShadowResult &result = results[(start + i) % results.size()];
+            cout << "  Request #" << result.passengerId << ": primary driver #" << result.primaryDriverId
+                 << " (" << result.primaryDistance << " km, " << result.primaryLatencyUs << " us), shadow driver #"
+                 << result.shadowDriverId << " (" << result.shadowDistance << " km, "
+                 << result.shadowLatencyUs << " us)" << endl;
+        }
+        cout << "-------------------------------------------------------\n"
+             << endl;
+    }
+};
+
+// Discards everything written to cout while in scope; used when running a
+// forked engine so simulated dispatch does not look like live output
+class SilencedOutput
+{
+private:
+    streambuf *saved;
+    ios_base::fmtflags savedFlags;
+    streamsize savedPrecision;
+
+public:
+    SilencedOutput() : saved(cout.rdbuf(nullptr)), savedFlags(cout.flags()), savedPrecision(cout.precision()) {}
+
+    // Formatting changed while silenced (fixed, setprecision) is undone too
+    ~SilencedOutput()
+    {
+        cout.rdbuf(saved);
+        cout.flags(savedFlags);
+        cout.precision(savedPrecision);
+    }
+};
+
+// A value shared between an engine and its forks until one of them changes
+// it; write() copies it first if anyone else still holds it
+template <typename T>
+class CopyOnWrite
+{
+private:
+    shared_ptr<T> value;
+
+public:
+    CopyOnWrite() : value(make_shared<T>()) {}
+
+    const T &operator*() const
+    {
+        return *value;
+    }
+
+    const T *operator->() const
+    {
+        return value.get();
+    }
+
+    T &write()
+    {
+        if (value.use_count() > 1)
+        {
+            value = make_shared<T>(*value);
+        }
+        return *value;
+    }
+};
+
+// Outcome of dispatching on a forked engine
+struct DispatchTotals
+{
+    int matched;
+    double pickupKm;
+};
+
+// Ride-sharing system
+class RideSharingSystem
+{
+private:
+    SpatialShardIndex locationIndex;
+    CopyOnWrite<unordered_map<int, shared_ptr<Driver>>> drivers;
+    CopyOnWrite<unordered_map<int, shared_ptr<Passenger>>> pendingRequests;
+    CopyOnWrite<unordered_map<int, string>> driverGeohashes;
+    shared_ptr<DriverHotTable> hotDrivers;
+    shared_ptr<FleetIndex> fleetIndex;
+    CopyOnWrite<RequestDeduplicator> requestKeys;
+    AdmissionController admission;
+    unordered_set<int> deferredReindex; // drivers whose trie position lags their location
+    DispatchScheduler scheduler;
+    deque<pair<int, chrono::steady_clock::time_point>> rideQueue; // passenger ID and enqueue time
+    unordered_map<int, pair<double, double>> queuedLocations;      // latest ping per driver
+    deque<int> locationOrder;
+    chrono::steady_clock::time_point lastExpirySweep;
+    chrono::steady_clock::time_point lastRebalance;
+    chrono::steady_clock::time_point lastDeltaMerge;
+    unique_ptr<EventLog> eventLog;
+    NearbyTileCache nearbyTiles;
+    CopyOnWrite<TripTracker> tripTracker;
+    ChangeStream changes;
+    uint64_t nextEventSequence;
+    vector<pair<int, unique_ptr<EventLog>>> changeFileSinks; // subscriber and its file
+    SharedDriverTable sharedDrivers;
+    MetricsRegistry metrics;
+    unique_ptr<MetricsServer> metricsServer;
+    SlowMatchLog slowMatches;
+    unique_ptr<EventExporter> exporter;
+    DispatchTotals dispatchTotals;
+    unique_ptr<ShadowMatcher> shadowMatcher;
+    TripUpdateSink tripUpdateSink; // the passenger-facing network layer, if attached
+    DropoffIndex dropoffs;
+    unordered_map<int, shared_ptr<Passenger>> nextPickups; // driver on a trip -> passenger booked with them
+    int nextDriverId;
+    int nextPassengerId;
+
+    struct ForkTag
+    {
+    };
+
+    // Copies the dispatch state of another engine. The driver, request and
+    // trip tables, the drivers and passengers in them and trie nodes are
+    // shared and copied on write; outputs such as the event
+    // log, exporters, shared memory and metrics are not carried over.
+    RideSharingSystem(const RideSharingSystem &source, ForkTag)
+        : locationIndex(source.locationIndex),
+          drivers(source.drivers),
+          pendingRequests(source.pendingRequests),
+          driverGeohashes(source.driverGeohashes),
+          hotDrivers(source.hotDrivers),
+          fleetIndex(source.fleetIndex),
+          requestKeys(source.requestKeys),
+          admission(source.admission),
+          deferredReindex(source.deferredReindex),
+          scheduler(source.scheduler),
+          rideQueue(source.rideQueue),
+          queuedLocations(source.queuedLocations),
+          locationOrder(source.locationOrder),
+          lastExpirySweep(source.lastExpirySweep),
+          lastRebalance(source.lastRebalance),
+          lastDeltaMerge(source.lastDeltaMerge),
+          tripTracker(source.tripTracker),
+          nextEventSequence(source.nextEventSequence),
+          dispatchTotals{0, 0.0},
+          dropoffs(source.dropoffs),
+          nextPickups(source.nextPickups),
+          nextDriverId(source.nextDriverId),
+          nextPassengerId(source.nextPassengerId)
+    {
+    }
+
+    // Drivers may be shared with a forked engine; copy one before changing it
+    Driver &mutableDriver(int driverId)
+    {
+        shared_ptr<Driver> &driver = drivers.write()[driverId];
+        if (driver.use_count() > 1)
+        {
+            driver = make_shared<Driver>(*driver);
+        }
+        return *driver;
+    }
+
+    // Mirrors a driver's current state into the hot table and the fleet
+    // indexes, copying either first if a forked engine still shares it
+    void refreshDriverIndexes(const Driver &driver)
+    {
+        if (hotDrivers.use_count() > 1)
+        {
+            hotDrivers = make_shared<DriverHotTable>(*hotDrivers);
+        }
+        if (fleetIndex.use_count() > 1)
+        {
+            fleetIndex = make_shared<FleetIndex>(*fleetIndex);
+        }
+        hotDrivers->upsert(driver, driverGeohashes->at(driver.id));
+        fleetIndex->update(driver);
+    }
+
+    void assignDriver(int passengerId, int driverId, double distance)
+    {
+        mutableDriver(driverId).setAvailable(false);
+        markDriverTileDirty(driverId);
+        tripTracker.write().startTrip(driverId, passengerId);
+        recordMatch(passengerId, driverId, distance);
+    }
+
+    // Books a driver still on a trip; the ride starts when the trip completes
+    void queueNextPickup(int passengerId, int driverId, double distance)
+    {
+        nextPickups[driverId] = pendingRequests->at(passengerId);
+        dropoffs.remove(driverId);
+        recordMatch(passengerId, driverId, distance);
+    }
+
+    // Puts the passenger booked with a driver back in the dispatch queue
+    void releaseBooking(int driverId)
+    {
+        auto booking = nextPickups.find(driverId);
+        if (booking == nextPickups.end())
+        {
+            return;
+        }
+        int passengerId = booking->second->id;
+        pendingRequests.write()[passengerId] = booking->second;
+        rideQueue.emplace_back(passengerId, chrono::steady_clock::now());
+        nextPickups.erase(booking);
+        cout << "Ride request #" << passengerId << " booked with driver #" << driverId
+             << " returned to the queue" << endl;
+    }
+
+    void forgetRequestKey(int passengerId)
+    {
+        const string &key = pendingRequests->at(passengerId)->idempotencyKey;
+        if (!key.empty())
+        {
+            requestKeys.write().forget(key);
+        }
+    }
+
+    void recordMatch(int passengerId, int driverId, double distance)
+    {
+        forgetRequestKey(passengerId);
+        pendingRequests.write().erase(passengerId);
+        recordEvent(EVENT_RIDE_MATCHED, driverId, passengerId);
+        metrics.increment(METRIC_MATCHES);
+        dispatchTotals.matched++;
+        dispatchTotals.pickupKm += distance;
+    }
+
+    void markDriverTileDirty(int driverId)
+    {
+        const Location &location = drivers->at(driverId)->location;
+        nearbyTiles.markDirty(NearbyTileCache::tileOf(location.latitude, location.longitude));
+    }
+
+    void recordEvent(EventType type, int driverId, int passengerId = 0)
+    {
+        EngineEvent event{};
+        event.sequence = nextEventSequence++;
+        event.timestampMs = currentTimeMs();
+        event.type = type;
+        event.driverId = driverId;
+        event.passengerId = passengerId;
+        auto it = drivers->find(driverId);
+        if (it != drivers->end())
+        {
+            event.latitude = it->second->location.latitude;
+            event.longitude = it->second->location.longitude;
+            event.available = it->second->available;
+            sharedDrivers.publish(*it->second);
+            refreshDriverIndexes(*it->second);
+        }
+
+        changes.publish(event);
+        if (eventLog)
+        {
+            eventLog->append(event);
+        }
+        if (exporter && EventExporter::isExported(type) && !exporter->enqueue(event))
+        {
+            metrics.increment(METRIC_EXPORT_DROPPED);
+        }
+    }
+
+    void drainChangeFileSinks()
+    {
+        for (auto &sink : changeFileSinks)
+        {
+            vector<EngineEvent> batch;
+            while (!(batch = readChanges(sink.first, CHANGE_STREAM_CAPACITY)).empty())
+            {
+                for (const EngineEvent &event : batch)
+                {
+                    sink.second->append(event);
+                }
+            }
+            sink.second->flush();
+        }
+    }
+
+public:
+    RideSharingSystem()
+        : hotDrivers(make_shared<DriverHotTable>()), fleetIndex(make_shared<FleetIndex>()), nextEventSequence(1), dispatchTotals{0, 0.0}, nextDriverId(1), nextPassengerId(1) {}
+
+    // Cheap copy of the current dispatch state for what-if evaluation; the
+    // fork can be mutated freely without disturbing this engine
+    unique_ptr<RideSharingSystem> fork() const
+    {
+        return unique_ptr<RideSharingSystem>(new RideSharingSystem(*this, ForkTag()));
+    }
+
+    // Starts appending state changes to a log file that followers can tail
+    bool attachEventLog(const string &path)
+    {
+        eventLog = make_unique<EventLog>(path);
+        if (!eventLog->isOpen())
+        {
+            cout << "Could not open event log " << path << endl;
+            eventLog.reset();
+            return false;
+        }
+        cout << "Writing events to " << path
+             << (eventLog->usesIoUring() ? " (io_uring)" : "") << endl;
+        return true;
+    }
+
+    int addDriver(double latitude, double longitude, VehicleClass vehicleClass = VEHICLE_STANDARD)
+    {
+        int driverId = nextDriverId++;
+        auto driver = make_shared<Driver>(driverId, latitude, longitude, vehicleClass);
+        drivers.write()[driverId] = driver;
+
+        // Add to geohash trie
         string geohash = Geohash::encode(latitude, longitude);
-        driverGeohashes[driverId] = geohash;
-        locationTrie->insertDriver(geohash, driverId);
+        driverGeohashes.write()[driverId] = geohash;
+        locationIndex.insertDriver(geohash, driverId);
+        nearbyTiles.markDirty(NearbyTileCache::tileOf(latitude, longitude));
+
+        recordEvent(EVENT_DRIVER_ADDED, driverId);
+
+        cout << "Added " << vehicleClassName(vehicleClass) << " driver #" << driverId << " at location ("
+             << latitude << ", " << longitude << ") with geohash " << geohash << endl;
+
+        return driverId;
+    }
+
+    void updateDriverLocation(int driverId, double latitude, double longitude)
+    {
+        if (drivers->find(driverId) == drivers->end())
+        {
+            cout << "Driver #" << driverId << " not found!" << endl;
+            return;
+        }
+
+        auto startTime = chrono::steady_clock::now();
+        Driver *driver = &mutableDriver(driverId);
+        nearbyTiles.markDirty(NearbyTileCache::tileOf(driver->location.latitude, driver->location.longitude));
+        nearbyTiles.markDirty(NearbyTileCache::tileOf(latitude, longitude));
+
+        if (admission.shouldCoalesceLocations())
+        {
+            // Under load only the position is recorded; the trie catches up later
+            driver->updateLocation(latitude, longitude);
+            deferredReindex.insert(driverId);
+            admission.recordCoalescedPing();
+        }
+        else
+        {
+            // Remove from old geohash
+            if (driverGeohashes->find(driverId) != driverGeohashes->end())
+            {
+                locationIndex.removeDriver(driverGeohashes->at(driverId), driverId);
+            }
+
+            // Update location
+            driver->updateLocation(latitude, longitude);
+
+            // Add to new geohash
+            string geohash = Geohash::encode(latitude, longitude);
+            if (driverGeohashes->at(driverId) != geohash)
+            {
+                metrics.increment(METRIC_CELL_TRANSITIONS);
+            }
+            driverGeohashes.write()[driverId] = geohash;
+            locationIndex.insertDriver(geohash, driverId);
+
+            cout << "Updated driver #" << driverId << " location to ("
+                 << latitude << ", " << longitude << ") with geohash " << geohash << endl;
+        }
+
+        tripTracker.write().record(driverId, latitude, longitude);
+        recordEvent(EVENT_DRIVER_MOVED, driverId);
+
+        long long latency = elapsedMicros(startTime);
+        metrics.increment(METRIC_LOCATION_UPDATES);
+        metrics.observe(METRIC_LOCATION_UPDATE_LATENCY, latency);
+        admission.recordLocationUpdate(latency, pendingRequests->size());
+        if (admission.getState() == AdmissionController::NORMAL && !deferredReindex.empty())
+        {
+            flushDeferredLocations();
+        }
+    }
+
+    // Moves coalesced drivers to the trie cell of their latest location
+    void flushDeferredLocations()
+    {
+        for (int driverId : deferredReindex)
+        {
+            auto it = drivers->find(driverId);
+            if (it == drivers->end())
+            {
+                continue;
+            }
+
+            string geohash = Geohash::encode(it->second->location.latitude, it->second->location.longitude);
+            string &current = driverGeohashes.write()[driverId];
+            if (current != geohash)
+            {
+                locationIndex.removeDriver(current, driverId);
+                locationIndex.insertDriver(geohash, driverId);
+                current = geohash;
+                metrics.increment(METRIC_CELL_TRANSITIONS);
+                nearbyTiles.markDirty(geohash.substr(0, NEARBY_TILE_PRECISION));
+                refreshDriverIndexes(*it->second);
+            }
+        }
+        deferredReindex.clear();
+    }
+
+    void setDriverAvailability(int driverId, bool available)
+    {
+        if (drivers->find(driverId) == drivers->end())
+        {
+            cout << "Driver #" << driverId << " not found!" << endl;
+            return;
+        }
+
+        // A manual change cancels the driver's plans after the current trip,
+        // and making them available ends that trip
+        releaseBooking(driverId);
+        dropoffs.remove(driverId);
+        if (available)
+        {
+            int passengerId = tripTracker.write().endTrip(driverId);
+            if (passengerId != 0)
+            {
+                cout << "Ended driver #" << driverId << "'s trip for ride request #" << passengerId << endl;
+            }
+        }
+        mutableDriver(driverId).setAvailable(available);
+        markDriverTileDirty(driverId);
+        recordEvent(EVENT_DRIVER_AVAILABILITY, driverId);
+        cout << "Set driver #" << driverId << " availability to "
+             << (available ? "available" : "unavailable") << endl;
+    }
+
+    // Queues a ride request for the next dispatch tick. A non-empty
+    // idempotencyKey makes client retries return the original request.
+    int submitRideRequest(double latitude, double longitude, const string &idempotencyKey = "")
+    {
+        if (!idempotencyKey.empty())
+        {
+            int existingId = requestKeys->find(idempotencyKey);
+            if (existingId != -1)
+            {
+                cout << "Duplicate ride request with key " << idempotencyKey
+                     << ", returning request #" << existingId << endl;
+                return existingId;
+            }
+        }
+
+        int passengerId = nextPassengerId++;
+        if (!idempotencyKey.empty())
+        {
+            requestKeys.write().remember(idempotencyKey, passengerId);
+        }
+        auto passenger = make_shared<Passenger>(passengerId, latitude, longitude);
+        passenger->idempotencyKey = idempotencyKey;
+        pendingRequests.write()[passengerId] = passenger;
+        rideQueue.emplace_back(passengerId, chrono::steady_clock::now());
+
+        cout << "New ride request #" << passengerId << " at location ("
+             << latitude << ", " << longitude << ")" << endl;
+
+        return passengerId;
+    }
+
+    // Queues a location ping; repeated pings for a driver before the next tick
+    // collapse into the latest one
+    void submitLocationUpdate(int driverId, double latitude, double longitude)
+    {
+        if (drivers->find(driverId) == drivers->end())
+        {
+            cout << "Driver #" << driverId << " not found!" << endl;
+            return;
+        }
+
+        auto it = queuedLocations.find(driverId);
+        if (it != queuedLocations.end())
+        {
+            it->second = {latitude, longitude};
+            return;
+        }
+        queuedLocations[driverId] = {latitude, longitude};
+        locationOrder.push_back(driverId);
+    }
+
+    // Delivers buffered trip positions, writes out buffered events and
+    // drains change-file subscribers; runs at the end of every tick
+    void flushLogs()
+    {
+        flushTripUpdates();
+        if (eventLog)
+        {
+            eventLog->flush();
+        }
+        drainChangeFileSinks();
+    }
+
+    // Runs one dispatch tick: matching, then location updates, then expiry,
+    // then maintenance, each within its own time budget
+    void runTick()
+    {
+        auto startTime = chrono::steady_clock::now();
+        scheduler.runTick([this](WorkClass workClass)
+                          { return runWorkStep(workClass); });
+        flushLogs();
+
+        metrics.observe(METRIC_TICK_LATENCY, elapsedMicros(startTime));
+        metrics.setGauge(METRIC_PENDING_REQUESTS, pendingRequests->size());
+        metrics.setGauge(METRIC_QUEUED_RIDE_REQUESTS, rideQueue.size());
+        metrics.setGauge(METRIC_QUEUED_LOCATION_UPDATES, queuedLocations.size());
+        metrics.setGauge(METRIC_DRIVERS, drivers->size());
+        metrics.setGauge(METRIC_ADMISSION_STATE, admission.getState());
+    }
+
+    // With a budget, cells are searched nearest first and the best driver
+    // found when the budget runs out is taken instead of the nearest overall
+    void matchRideRequest(int passengerId, long long budgetUs = 0)
+    {
+        if (pendingRequests->find(passengerId) == pendingRequests->end())
+        {
+            cout << "Ride request #" << passengerId << " not found!" << endl;
+            return;
+        }
+
+        auto startTime = chrono::steady_clock::now();
+        auto passenger = pendingRequests->at(passengerId);
+        string passengerGeohash = Geohash::encode(
+            passenger->location.latitude,
+            passenger->location.longitude);
+
+        MatchTrace trace{};
+        trace.passengerId = passengerId;
+        trace.latitude = passenger->location.latitude;
+        trace.longitude = passenger->location.longitude;
+        trace.geohash = passengerGeohash;
+        trace.encodeUs = elapsedMicros(startTime);
+
+        cout << "Matching ride request #" << passengerId << " with geohash " << passengerGeohash << endl;
+
+        priority_queue<DriverMatch, vector<DriverMatch>, greater<DriverMatch>> driverHeap;
+        ShadowJob shadowJob{};
+
+        // The widest search area is the passenger's MATCH_CELL_PRECISION cell
+        // and its neighbours; their counts give both plans' worst-case cost
+        vector<int> searchCells;
+        int availableNearby = 0;
+        double indexCost = (GEOHASH_PRECISION - MATCH_CELL_PRECISION + 1) * 9 * INDEX_PROBE_COST;
+        for (const auto &geohash : Geohash::adjacentCells(passengerGeohash.substr(0, MATCH_CELL_PRECISION)))
+        {
+            int cell = DriverHotTable::cellOf(geohash);
+            searchCells.push_back(cell);
+            availableNearby += hotDrivers->availableInCell(cell);
+            indexCost += hotDrivers->driversInCell(cell) * INDEX_CANDIDATE_COST;
+        }
+        double scanCost = hotDrivers->availableSize() * SCAN_DRIVER_COST;
+        trace.scanned = scanCost < indexCost;
+        cout << "Candidate search: " << (trace.scanned ? "scan" : "index") << " (about "
+             << availableNearby << " available nearby, cost " << fixed << setprecision(0)
+             << indexCost << " index vs " << scanCost << " scan)" << endl;
+
+        if (trace.scanned)
+        {
+            metrics.increment(METRIC_SCAN_SEARCHES);
+            trace.cellsScanned = searchCells.size();
+            hotDrivers->scanCells(searchCells, [&](int driverId, double latitude, double longitude,
+                                                   chrono::system_clock::time_point lastActive)
+                                  {
+                double distance = passenger->location.distanceTo(Location(latitude, longitude));
+                driverHeap.push(DriverMatch(driverId, distance, lastActive));
+                trace.candidatesFound++;
+                if (shadowMatcher)
+                {
+                    snapshotShadowCandidate(shadowJob, driverId, Location(latitude, longitude), lastActive);
+                } });
+        }
+        else
+        {
+            metrics.increment(METRIC_INDEX_SEARCHES);
+
+            // Rings of ever coarser cells around the passenger: a ring ends the
+            // search once the best driver is closer than anything outside it
+            unordered_set<int> seen;
+            for (int precision = GEOHASH_PRECISION; precision >= MATCH_CELL_PRECISION && !trace.deadlineHit; precision--)
+            {
+                string center = passengerGeohash.substr(0, precision);
+                for (const auto &geohash : Geohash::adjacentCells(center))
+                {
+                    // With nothing found yet, keep going past the budget
+                    if (budgetUs > 0 && !driverHeap.empty() && elapsedMicros(startTime) > budgetUs)
+                    {
+                        trace.deadlineHit = true;
+                        break;
+                    }
+
+                    vector<int> nearbyDriverIds = locationIndex.findDriversWithPrefix(geohash, &fleetIndex->available());
+                    trace.cellsScanned++;
+                    trace.candidatesFound += nearbyDriverIds.size();
+
+                    for (int driverId : nearbyDriverIds)
+                    {
+                        if (!seen.insert(driverId).second)
+                        {
+                            continue; // already found in a finer ring
+                        }
+                        if (drivers->find(driverId) != drivers->end() && drivers->at(driverId)->available)
+                        {
+                            double distance = passenger->location.distanceTo(drivers->at(driverId)->location);
+                            driverHeap.push(DriverMatch(
+                                driverId,
+                                distance,
+                                drivers->at(driverId)->lastActive));
+                            if (shadowMatcher)
+                            {
+                                snapshotShadowCandidate(shadowJob, driverId, drivers->at(driverId)->location,
+                                                        drivers->at(driverId)->lastActive);
+                            }
+                        }
+                    }
+                }
+
+                if (!driverHeap.empty() && driverHeap.top().distance <= ringClearance(passenger->location, center))
+                {
+                    break;
+                }
+            }
+
+            if (trace.deadlineHit)
+            {
+                metrics.increment(METRIC_DEADLINE_MATCHES);
+                cout << "Search budget of " << budgetUs << " us spent; taking the best driver found so far" << endl;
+            }
+        }
+
+        // Drivers about to drop off nearby compete on pickup ETA: the drive
+        // from their dropoff plus the distance their remaining trip time is worth
+        dropoffs.forEachNear(passengerGeohash, [&](int driverId, const Location &dropoff, long long secondsRemaining)
+                             {
+            double pickupKm = passenger->location.distanceTo(dropoff);
+            driverHeap.push(DriverMatch(driverId, pickupKm, secondsRemaining, drivers->at(driverId)->lastActive));
+            if (shadowMatcher)
+            {
+                snapshotShadowCandidate(shadowJob, driverId, dropoff, drivers->at(driverId)->lastActive, secondsRemaining);
+            } });
+
+        trace.availableCandidates = driverHeap.size();
+        trace.candidatesUs = elapsedMicros(startTime) - trace.encodeUs;
+        metrics.observe(METRIC_MATCH_CANDIDATES_LATENCY, elapsedMicros(startTime));
+
+        if (driverHeap.empty())
+        {
+            metrics.increment(METRIC_FAILED_MATCHES);
+            finishMatchTrace(trace, startTime, driverHeap);
+            submitShadowJob(shadowJob, trace, 0);
+            cout << "No available drivers found for ride request #" << passengerId << endl;
+            return;
+        }
+
+        // Get the best match (nearest driver)
+        DriverMatch bestMatch = driverHeap.top();
+        int matchedDriverId = bestMatch.driverId;
+
+        // Assign the driver
+        if (bestMatch.finishingTrip)
+        {
+            queueNextPickup(passengerId, matchedDriverId, bestMatch.pickupDistance);
+        }
+        else
+        {
+            assignDriver(passengerId, matchedDriverId, bestMatch.pickupDistance);
+        }
+        trace.matchedDriverId = matchedDriverId;
+        finishMatchTrace(trace, startTime, driverHeap);
+        submitShadowJob(shadowJob, trace, bestMatch.pickupDistance);
+
+        cout << "Matched ride request #" << passengerId << " with driver #"
+             << matchedDriverId << " (distance: " << fixed << setprecision(2)
+             << bestMatch.pickupDistance << " km)" << endl;
+        if (bestMatch.finishingTrip)
+        {
+            cout << "Driver #" << matchedDriverId << " will pick up after finishing the current trip" << endl;
+        }
+
+             cout <<  "\n\n " << endl;
+    }
+
+    // Matches all pending requests together: every request/driver pair
+    // within BATCH_MATCH_RADIUS_KM is considered and the closest pairs are
+    // assigned first
+    void dispatchPendingBatch()
+    {
+        vector<tuple<double, int, int>> pairs = joinRequestsWithDrivers(BATCH_MATCH_RADIUS_KM);
+        cout << "Batch dispatch: " << pairs.size() << " candidate pairs for "
+             << pendingRequests->size() << " requests" << endl;
+
+        sort(pairs.begin(), pairs.end());
+        for (const auto &pair : pairs)
+        {
+            int passengerId = get<1>(pair), driverId = get<2>(pair);
+            if (pendingRequests->count(passengerId) && drivers->at(driverId)->available)
+            {
+                assignDriver(passengerId, driverId, get<0>(pair));
+                cout << "Batch matched ride request #" << passengerId << " with driver #" << driverId << endl;
+            }
+        }
+    }
+
+    // Every (distance, passenger, driver) triple of a pending request and an
+    // available driver at most radiusKm apart. Both sides are put on a grid
+    // of cells at least radiusKm across and sorted by the cells' Morton
+    // codes; each occupied request cell then looks up the driver ranges of
+    // its nine neighbour cells once for all the requests in it.
+    vector<tuple<double, int, int>> joinRequestsWithDrivers(double radiusKm) const
+    {
+        struct JoinPoint
+        {
+            uint64_t code;
+            uint32_t column;
+            uint32_t row;
+            int id;
+            Location location;
+        };
+
+        vector<JoinPoint> requests, available;
+        double maxAbsLatitude = 0;
+        for (const auto &request : *pendingRequests)
+        {
+            requests.push_back({0, 0, 0, request.first, request.second->location});
+            maxAbsLatitude = max(maxAbsLatitude, abs(request.second->location.latitude));
+        }
+        hotDrivers->forEachAvailable([&](int driverId, double latitude, double longitude)
+                                     {
+            available.push_back({0, 0, 0, driverId, Location(latitude, longitude)});
+            maxAbsLatitude = max(maxAbsLatitude, abs(latitude)); });
+
+        vector<tuple<double, int, int>> pairs;
+        if (requests.empty() || available.empty())
+        {
+            return pairs;
+        }
+
+        // Columns are sized for the highest latitude in the batch, where a
+        // degree of longitude is shortest, and divide the globe evenly so
+        // the column across the antimeridian is as wide as the rest
+        const double kmPerDegree = 6371.0 * M_PI / 180.0;
+        double cellLatitude = radiusKm / kmPerDegree;
+        double minCellLongitude = radiusKm / (kmPerDegree * cos(min(maxAbsLatitude, 89.0) * M_PI / 180.0));
+        uint32_t columns = max(1.0, floor(360.0 / minCellLongitude));
+        double cellLongitude = 360.0 / columns;
+        uint32_t rows = (uint32_t)(180.0 / cellLatitude) + 1;
+
+        auto place = [&](JoinPoint &point)
+        {
+            point.column = min(columns - 1, (uint32_t)((point.location.longitude + 180.0) / cellLongitude));
+            point.row = min(rows - 1, (uint32_t)((point.location.latitude + 90.0) / cellLatitude));
+            point.code = mortonCode(point.column, point.row);
+        };
+        auto byCode = [](const JoinPoint &a, const JoinPoint &b)
+        {
+            return a.code < b.code;
+        };
+        for_each(requests.begin(), requests.end(), place);
+        for_each(available.begin(), available.end(), place);
+        sort(requests.begin(), requests.end(), byCode);
+        sort(available.begin(), available.end(), byCode);
+
+        for (size_t first = 0, last; first < requests.size(); first = last)
+        {
+            last = first;
+            while (last < requests.size() && requests[last].code == requests[first].code)
+            {
+                last++;
+            }
+
+            // Neighbouring columns wrap around the antimeridian
+            vector<uint64_t> neighbours;
+            for (int dRow = -1; dRow <= 1; dRow++)
+            {
+                long long row = (long long)requests[first].row + dRow;
+                if (row < 0 || row >= rows)
+                {
+                    continue;
+                }
+                for (int dColumn = -1; dColumn <= 1; dColumn++)
+                {
+                    uint32_t column = (requests[first].column + columns + dColumn) % columns;
+                    neighbours.push_back(mortonCode(column, row));
+                }
+            }
+            sort(neighbours.begin(), neighbours.end());
+            neighbours.erase(unique(neighbours.begin(), neighbours.end()), neighbours.end());
+
+            for (uint64_t code : neighbours)
+            {
+                JoinPoint key{code, 0, 0, 0, Location(0, 0)};
+                auto range = equal_range(available.begin(), available.end(), key, byCode);
+                for (size_t r = first; r < last; r++)
+                {
+                    for (auto driver = range.first; driver != range.second; ++driver)
+                    {
+                        double distance = requests[r].location.distanceTo(driver->location);
+                        if (distance <= radiusKm)
+                        {
+                            pairs.emplace_back(distance, requests[r].id, driver->id);
+                        }
+                    }
+                }
+            }
+        }
+        return pairs;
+    }
+
+    // What-if: dispatches the current pending requests on two forks, one
+    // request at a time and as a single batch, and reports both outcomes
+    // without touching this engine
+    void compareDispatchPolicies() const
+    {
+        auto sequential = fork();
+        auto batched = fork();
+        auto startTime = chrono::steady_clock::now();
+        {
+            SilencedOutput silence;
+
+            vector<int> requestIds;
+            for (const auto &request : *sequential->pendingRequests)
+            {
+                requestIds.push_back(request.first);
+            }
+            sort(requestIds.begin(), requestIds.end());
+            for (int passengerId : requestIds)
+            {
+                sequential->matchRideRequest(passengerId);
+            }
+
+            batched->dispatchPendingBatch();
+        }
+
+        auto report = [](const char *name, const DispatchTotals &totals)
+        {
+            cout << name << ": " << totals.matched << " matched, average pickup "
+                 << fixed << setprecision(2)
+                 << (totals.matched ? totals.pickupKm / totals.matched : 0.0) << " km" << endl;
+        };
+        cout << "\n--- Dispatch What-If (" << pendingRequests->size() << " pending requests) ---" << endl;
+        report("One at a time", sequential->dispatchTotals);
+        report("Batched", batched->dispatchTotals);
+        cout << "Evaluated in " << elapsedMicros(startTime) << " us" << endl;
+        cout << "-------------------------------------------------------\n"
+             << endl;
+    }
+
+    void processExpiredRequests()
+    {
+        vector<int> expiredIds;
+
+        for (const auto &pair : *pendingRequests)
+        {
+            if (pair.second->isExpired())
+            {
+                expiredIds.push_back(pair.first);
+            }
+        }
+
+        for (int id : expiredIds)
+        {
+            cout << "Ride request #" << id << " expired after waiting for "
+                 << pendingRequests->at(id)->getWaitTime() << endl;
+            forgetRequestKey(id);
+            pendingRequests.write().erase(id);
+            recordEvent(EVENT_RIDE_EXPIRED, 0, id);
+            metrics.increment(METRIC_EXPIRATIONS);
+        }
+    }
+
+    void displayStats()
+    {
+        if (!admission.admitStats())
+        {
+            cout << "System under load, statistics request rejected" << endl;
+            return;
+        }
+
+        cout << "\n--- System Statistics ---" << endl;
+        cout << "Total Drivers: " << drivers->size() << endl;
+
+        int availableDrivers = 0;
+       
+
+        cout << "\t\t\tAvailable Drivers: "  << endl;
+        cout << "+----+------------------+-------+----------+----------+" << endl;
+        cout << "| ID |       Latitude       |           Longitude     |" << endl;
+        cout << "+----+------------------+-------+----------+----------+" << endl;
+        for (const auto &pair : *drivers)
+        {
+            if (pair.second->available)
+            {
+                cout << "| " << (pair.second->id) <<" |       " << pair.second->location.latitude << "       |           " << pair.second->location.longitude <<"     |" << endl;
+                // cout <<  << " -> " << (pair.second->location.latitude)  << " :: "<< pair.second->location.longitude << endl;
+                availableDrivers++;
+            }
+        }
+        cout << "+----+------------------+-------+----------+----------+" << endl;
+        cout << "Total Available Drivers : " << availableDrivers << endl;
+        cout << "Pending Ride Requests: " << pendingRequests->size() << endl;
+
+        if (!pendingRequests->empty())
+        {
+            cout << "\nPending Requests:" << endl;
+            for (const auto &pair : *pendingRequests)
+            {
+                cout << "  Request #" << pair.first << " - Waiting for "
+                     << pair.second->getWaitTime() << endl;
+            }
+        }
+
+        cout << "-------------------------------------------------------\n"
+             << endl;
+             cout << "\n\n " << endl;
+    }
+
+    void displayAdmissionState() const
+    {
+        admission.display();
+        cout << "Queued ride requests: " << rideQueue.size() << endl;
+        cout << "Queued location updates: " << queuedLocations.size() << endl;
+        scheduler.display();
+    }
+
+    void displayShardLoad() const
+    {
+        locationIndex.display();
+    }
+
+    // Lays shards out from a snapshot of where drivers and riders are now.
+    // The engine starts with no fleet, so this is run from the admin menu
+    // once drivers have been added; periodic rebalancing adjusts it after.
+    void computeShardLayout()
+    {
+        vector<long long> demand(SHARD_PREFIX_COUNT, 0);
+        for (const auto &pair : *pendingRequests)
+        {
+            string geohash = Geohash::encode(pair.second->location.latitude,
+                                             pair.second->location.longitude,
+                                             SHARD_PREFIX_LENGTH);
+            int slot = SpatialShardIndex::prefixSlot(geohash);
+            if (slot >= 0)
+            {
+                demand[slot]++;
+            }
+        }
+        locationIndex.partitionByDensity(demand);
+    }
+
+    // Publishes driver state into a POSIX shared memory segment that local
+    // services can map read-only; every later driver change is written through
+    bool publishToSharedMemory(const char *name = SHARED_DRIVER_SEGMENT)
+    {
+        if (!sharedDrivers.create(name))
+        {
+            cout << "Could not create shared memory segment " << name << endl;
+            return false;
+        }
+        for (const auto &pair : *drivers)
+        {
+            sharedDrivers.publish(*pair.second);
+        }
+        cout << "Publishing driver table to shared memory " << name << endl;
+        return true;
+    }
+
+    // Streams match, expiry and availability events to rotating segment
+    // files in the given directory from a background thread
+    bool startEventExport(const string &directory)
+    {
+        error_code error;
+        filesystem::create_directories(directory, error);
+        if (error)
+        {
+            cout << "Could not create export directory " << directory << endl;
+            return false;
+        }
+        exporter = make_unique<EventExporter>(directory);
+        cout << "Exporting events to " << directory;
+        if (exporter->resumedFrom() > 0)
+        {
+            cout << " (continuing after sequence " << exporter->resumedFrom() << ")";
+        }
+        cout << endl;
+        if (nextEventSequence == 1 && exporter->resumedFrom() > 0)
+        {
+            // A fresh engine numbers its events after the previous run's so
+            // none of them fall below what the exporter skips
+            nextEventSequence = exporter->resumedFrom() + 1;
+            changes.restartAt(nextEventSequence);
+        }
+        else if (nextEventSequence <= exporter->resumedFrom())
+        {
+            cout << "Events up to sequence " << exporter->resumedFrom() << " are already exported and will be skipped" << endl;
+        }
+        return true;
+    }
+
+    // Serves Prometheus metrics on http://127.0.0.1:<port>/metrics
+    bool startMetricsServer(int port = METRICS_PORT)
+    {
+        metricsServer = make_unique<MetricsServer>(metrics);
+        if (!metricsServer->start(port))
+        {
+            cout << "Could not start metrics server on port " << port << endl;
+            metricsServer.reset();
+            return false;
+        }
+        cout << "Serving metrics on http://127.0.0.1:" << port << "/metrics" << endl;
+        return true;
+    }
+
+    // Registers a change-data-capture consumer; it sees every event from now on
+    int subscribeChanges()
+    {
+        return changes.subscribe();
+    }
+
+    void unsubscribeChanges(int subscriber)
+    {
+        if (changes.isSubscribed(subscriber))
+        {
+            changes.unsubscribe(subscriber);
+        }
+    }
+
+    // Returns up to maxEvents events after the subscriber's cursor. Events the
+    // ring has already overwritten are read back from the event log; any the
+    // log no longer holds (or no log at all) are skipped, and their count is
+    // stored in lostEvents so the consumer knows to resync from a snapshot.
+    vector<EngineEvent> readChanges(int subscriber, size_t maxEvents, uint64_t *lostEvents = nullptr)
+    {
+        vector<EngineEvent> batch;
+        if (lostEvents != nullptr)
+        {
+            *lostEvents = 0;
+        }
+        if (!changes.isSubscribed(subscriber))
+        {
+            return batch;
+        }
+
+        uint64_t oldest = changes.oldestSequence();
+        uint64_t cursor = changes.cursor(subscriber);
+        if (cursor < oldest)
+        {
+            if (eventLog)
+            {
+                // Only when the ring overran the subscriber within one tick
+                // are the events it needs still in the log's write buffers
+                if (eventLog->flushedSequence() < cursor)
+                {
+                    eventLog->flush();
+                }
+                batch = eventLog->readRange(cursor, oldest, maxEvents);
+            }
+
+            // The log resumes after the gap, or not at all
+            uint64_t resumed = batch.empty() ? oldest : batch.front().sequence;
+            if (resumed > cursor)
+            {
+                uint64_t lost = resumed - cursor;
+                cout << "Change subscriber #" << subscriber << " lost " << lost << " events" << endl;
+                metrics.increment(METRIC_CHANGES_LOST, lost);
+                if (lostEvents != nullptr)
+                {
+                    *lostEvents = lost;
+                }
+            }
+            if (!batch.empty())
+            {
+                changes.advance(subscriber, batch.back().sequence + 1);
+                return batch;
+            }
+            changes.advance(subscriber, oldest);
+        }
+
+        changes.read(subscriber, maxEvents, batch);
+        return batch;
+    }
+
+    // Events published but not yet read by the subscriber
+    uint64_t changeLag(int subscriber) const
+    {
+        return changes.isSubscribed(subscriber) ? changes.lag(subscriber) : 0;
+    }
+
+    // Mirrors the change stream into a local file, drained once per tick
+    bool addChangeFileSink(const string &path)
+    {
+        auto file = make_unique<EventLog>(path);
+        if (!file->isOpen())
+        {
+            cout << "Could not open change sink " << path << endl;
+            return false;
+        }
+        changeFileSinks.emplace_back(subscribeChanges(), move(file));
+        return true;
+    }
+
+    // Ends the driver's current trip and makes them available again
+    void completeTrip(int driverId)
+    {
+        int passengerId = tripTracker.write().endTrip(driverId);
+        if (passengerId == 0)
+        {
+            cout << "Driver #" << driverId << " has no active trip!" << endl;
+            return;
+        }
+
+        cout << "Driver #" << driverId << " completed trip for ride request #" << passengerId << endl;
+        dropoffs.remove(driverId);
+
+        auto queued = nextPickups.find(driverId);
+        if (queued != nextPickups.end())
+        {
+            // Straight on to the ride booked during this trip
+            tripTracker.write().startTrip(driverId, queued->second->id);
+            recordEvent(EVENT_RIDE_STARTED, driverId, queued->second->id);
+            cout << "Driver #" << driverId << " heading to ride request #" << queued->second->id << endl;
+            nextPickups.erase(queued);
+            return;
+        }
+        setDriverAvailability(driverId, true);
+    }
+
+    // Records where and when a driver on a trip expects to drop off, so the
+    // matcher can book them for a nearby request before they are free
+    void updateTripProgress(int driverId, double dropoffLatitude, double dropoffLongitude, long long secondsRemaining)
+    {
+        if (!tripTracker->isTracking(driverId))
+        {
+            cout << "Driver #" << driverId << " has no active trip!" << endl;
+            return;
+        }
+        if (nextPickups.count(driverId))
+        {
+            return; // already booked for the next ride
+        }
+        dropoffs.update(driverId, dropoffLatitude, dropoffLongitude, max(0LL, secondsRemaining));
+        cout << "Driver #" << driverId << " expected at dropoff in " << secondsRemaining << " s" << endl;
+    }
+
+    // Where each tick delivers the driver positions gathered for passengers
+    // tracking a trip; without a sink the batches are dropped
+    void setTripUpdateSink(TripUpdateSink sink)
+    {
+        tripUpdateSink = sink;
+    }
+
+    // Delivers the driver positions gathered since the last call to every
+    // passenger tracking a trip; flushLogs calls this once per tick
+    void flushTripUpdates()
+    {
+        tripTracker.write().flush([this](int passengerId, int driverId, const TrackingSample *samples, size_t count)
+                          {
+            if (tripUpdateSink)
+            {
+                tripUpdateSink(passengerId, driverId, samples, count);
+            } });
+    }
+
+    // Pre-serialized tile buffers for the tiles around a rider
+    vector<pair<string, string>> getNearbyCarTiles(double latitude, double longitude) const
+    {
+        return nearbyTiles.nearbyTiles(latitude, longitude);
+    }
+
+    void dumpSlowMatches() const
+    {
+        slowMatches.dump();
+    }
+
+    // Replays every match through an alternative policy on a separate thread
+    void startShadowMatcher(ShadowPolicy policy = ShadowMatcher::longestIdleNearby)
+    {
+        shadowMatcher = make_unique<ShadowMatcher>(policy);
+        cout << "Shadow matcher started" << endl;
+    }
+
+    // Freezes the available drivers into a read-only snapshot file that
+    // followers and simulations can map directly
+    bool saveIndexSnapshot(const string &path) const
+    {
+        vector<FrozenSpatialIndex::Entry> entries;
+        hotDrivers->forEachAvailable([&](int driverId, double latitude, double longitude)
+                                     { entries.push_back({driverId, latitude, longitude}); });
+
+        FrozenSpatialIndex snapshot;
+        snapshot.build(move(entries), nextEventSequence - 1);
+        if (!snapshot.save(path))
+        {
+            cout << "Could not write index snapshot " << path << endl;
+            return false;
+        }
+        cout << "Saved " << snapshot.size() << " available drivers to index snapshot " << path
+             << " (sequence " << snapshot.sequence() << ")" << endl;
+        return true;
+    }
+
+    // Drivers matching an operations query, answered from the fleet indexes
+    // and, for a zone, a filtered trie walk of just that prefix
+    vector<int> findFleetDrivers(const FleetQuery &query)
+    {
+        long long nowSeconds = chrono::duration_cast<chrono::seconds>(chrono::system_clock::now().time_since_epoch()).count();
+        DriverBitset selected = fleetIndex->select(query, nowSeconds);
+        if (query.zone.empty())
+        {
+            return selected.toVector();
+        }
+        return locationIndex.findDriversWithPrefix(query.zone, &selected);
+    }
+
+    void displayFleetQuery(const FleetQuery &query)
+    {
+        vector<int> driverIds = findFleetDrivers(query);
+        cout << "\n--- Fleet Query ---" << endl;
+        cout << "Zone " << (query.zone.empty() ? "*" : query.zone) << ", vehicle class "
+             << (query.vehicleClass < 0 ? "any" : vehicleClassName(query.vehicleClass)) << ", status "
+             << (query.available < 0 ? "any" : query.available ? "available" : "unavailable")
+             << ", idle over " << query.minIdleSeconds / 60 << " min: " << driverIds.size() << " drivers" << endl;
+        for (size_t i = 0; i < driverIds.size() && i < FLEET_QUERY_LISTED; i++)
+        {
+            const Driver &driver = *drivers->at(driverIds[i]);
+            cout << "  Driver #" << driver.id << " (" << vehicleClassName(driver.vehicleClass) << ") at ("
+                 << fixed << setprecision(6) << driver.location.latitude << ", " << driver.location.longitude
+                 << "), last active " << driver.getLastActiveTime() << endl;
+        }
+        if (driverIds.size() > FLEET_QUERY_LISTED)
+        {
+            cout << "  ... and " << driverIds.size() - FLEET_QUERY_LISTED << " more" << endl;
+        }
+        cout << "-------------------------------------------------------\n"
+             << endl;
+    }
 
-        cout << "Updated driver #" << driverId << " location to ("
-             << latitude << ", " << longitude << ") with geohash " << geohash << endl;
+    void displayShadowReport()
+    {
+        if (!shadowMatcher)
+        {
+            cout << "Shadow matcher is not running" << endl;
+            return;
+        }
+        shadowMatcher->display();
     }
 
-    void setDriverAvailability(int driverId, bool available)
+private:
+    // A driver finishing a trip is snapshotted at their dropoff
+    void snapshotShadowCandidate(ShadowJob &job, int driverId, const Location &location,
+                                 chrono::system_clock::time_point lastActive, long long secondsRemaining = 0)
     {
-        if (drivers.find(driverId) == drivers.end())
+        // The candidate scan can see a driver more than once
+        if (!job.candidateIds.insert(driverId).second)
         {
-            cout << "Driver #" << driverId << " not found!" << endl;
             return;
         }
+        job.candidates.push_back({driverId, location.latitude, location.longitude,
+                                  chrono::duration_cast<chrono::milliseconds>(lastActive.time_since_epoch()).count(),
+                                  secondsRemaining});
+    }
 
-        drivers[driverId]->setAvailable(available);
-        cout << "Set driver #" << driverId << " availability to "
-             << (available ? "available" : "unavailable") << endl;
+    void submitShadowJob(ShadowJob &job, const MatchTrace &trace, double distance)
+    {
+        if (!shadowMatcher)
+        {
+            return;
+        }
+        job.passengerId = trace.passengerId;
+        job.latitude = trace.latitude;
+        job.longitude = trace.longitude;
+        job.primaryDriverId = trace.matchedDriverId;
+        job.primaryDistance = distance;
+        job.primaryLatencyUs = trace.totalUs;
+        job.candidateIds.clear();
+        shadowMatcher->submit(move(job));
     }
 
-    int requestRide(double latitude, double longitude)
+    // Records match latency and, for slow matches, keeps the full trace
+    // including the nearest candidates still left in the heap
+    void finishMatchTrace(MatchTrace &trace, chrono::steady_clock::time_point startTime,
+                          priority_queue<DriverMatch, vector<DriverMatch>, greater<DriverMatch>> &candidates)
     {
-        
-        int passengerId = nextPassengerId++;
-        auto passenger = make_shared<Passenger>(passengerId, latitude, longitude);
-        pendingRequests[passengerId] = passenger;
+        trace.totalUs = elapsedMicros(startTime);
+        trace.selectUs = trace.totalUs - trace.encodeUs - trace.candidatesUs;
+        metrics.observe(METRIC_MATCH_LATENCY, trace.totalUs);
+        if (trace.totalUs <= SLOW_MATCH_THRESHOLD_US)
+        {
+            return;
+        }
 
-        cout << "New ride request #" << passengerId << " at location ("
-             << latitude << ", " << longitude << ")" << endl;
+        trace.timestampMs = currentTimeMs();
+        while (!candidates.empty() && trace.candidates.size() < SLOW_MATCH_CANDIDATES)
+        {
+            const DriverMatch &candidate = candidates.top();
+            const Location &location = drivers->at(candidate.driverId)->location;
+            trace.candidates.push_back({candidate.driverId, location.latitude, location.longitude, candidate.pickupDistance});
+            candidates.pop();
+        }
+        slowMatches.capture(move(trace));
+    }
 
-        // Try to match with a driver immediately
-        matchRideRequest(passengerId);
+    // coalesced maps tiles to drivers whose trie cell lags their location
+    vector<tuple<int, double, double>> collectTileCars(const string &tile,
+                                                       const unordered_map<string, vector<int>> &coalesced)
+    {
+        vector<tuple<int, double, double>> cars;
+        for (int driverId : locationIndex.findDriversWithPrefix(tile))
+        {
+            auto it = drivers->find(driverId);
+            if (it == drivers->end() || !it->second->available)
+            {
+                continue;
+            }
+            const Location &location = it->second->location;
+            if (NearbyTileCache::tileOf(location.latitude, location.longitude) == tile)
+            {
+                cars.emplace_back(driverId, location.latitude, location.longitude);
+            }
+        }
 
-        return passengerId;
+        auto moved = coalesced.find(tile);
+        if (moved != coalesced.end())
+        {
+            for (int driverId : moved->second)
+            {
+                const Location &location = drivers->at(driverId)->location;
+                cars.emplace_back(driverId, location.latitude, location.longitude);
+            }
+        }
+        return cars;
     }
 
-    void matchRideRequest(int passengerId)
+    // Coalesced drivers are still filed in the trie under their old cell, so
+    // a tile rebuild places them by location: available ones that have left
+    // their trie cell's tile, keyed by the tile they are in now
+    unordered_map<string, vector<int>> coalescedDriversByTile()
     {
-        if (pendingRequests.find(passengerId) == pendingRequests.end())
+        unordered_map<string, vector<int>> byTile;
+        for (int driverId : deferredReindex)
         {
-            cout << "Ride request #" << passengerId << " not found!" << endl;
-            return;
+            auto it = drivers->find(driverId);
+            if (it == drivers->end() || !it->second->available)
+            {
+                continue;
+            }
+            const Location &location = it->second->location;
+            string tile = NearbyTileCache::tileOf(location.latitude, location.longitude);
+            if (driverGeohashes->at(driverId).compare(0, tile.length(), tile) != 0)
+            {
+                byTile[tile].push_back(driverId);
+            }
         }
+        return byTile;
+    }
 
-        auto passenger = pendingRequests[passengerId];
-        string passengerGeohash = Geohash::encode(
-            passenger->location.latitude,
-            passenger->location.longitude);
+    // Distance from a point inside cell to the edge of the block formed by
+    // the cell and its eight neighbours
+    static double ringClearance(const Location &from, const string &cell)
+    {
+        auto origin = Geohash::cellOrigin(cell);
+        auto size = Geohash::cellSize(cell.length());
+        double south = origin.first - size.first;
+        double north = origin.first + 2 * size.first;
+        double west = origin.second - size.second;
+        double east = origin.second + 2 * size.second;
+        return min(min(from.distanceTo(Location(south, from.longitude)), from.distanceTo(Location(north, from.longitude))),
+                   min(from.distanceTo(Location(from.latitude, west)), from.distanceTo(Location(from.latitude, east))));
+    }
 
-        cout << "Matching ride request #" << passengerId << " with geohash " << passengerGeohash << endl;
-        
+    bool runWorkStep(WorkClass workClass)
+    {
+        switch (workClass)
+        {
+        case WORK_MATCHING:
+        {
+            if (rideQueue.empty())
+            {
+                return false;
+            }
+            auto entry = rideQueue.front();
+            rideQueue.pop_front();
+            if (pendingRequests->find(entry.first) != pendingRequests->end())
+            {
+                bool overloaded = admission.getState() != AdmissionController::NORMAL;
+                matchRideRequest(entry.first, overloaded ? MATCH_DEADLINE_US : 0);
+                admission.recordRideRequest(elapsedMicros(entry.second), pendingRequests->size());
+            }
+            return true;
+        }
+        case WORK_LOCATIONS:
+        {
+            if (locationOrder.empty())
+            {
+                return false;
+            }
+            int driverId = locationOrder.front();
+            locationOrder.pop_front();
+            auto position = queuedLocations[driverId];
+            queuedLocations.erase(driverId);
+            updateDriverLocation(driverId, position.first, position.second);
+            return true;
+        }
+        case WORK_EXPIRY:
+        {
+            auto now = chrono::steady_clock::now();
+            if (now - lastExpirySweep < chrono::seconds(EXPIRY_SWEEP_INTERVAL))
+            {
+                return false;
+            }
+            lastExpirySweep = now;
+            processExpiredRequests();
+            return false;
+        }
+        default:
+        {
+            if (!deferredReindex.empty() && admission.getState() == AdmissionController::NORMAL)
+            {
+                flushDeferredLocations();
+            }
+
+            if (nearbyTiles.rebuildDue())
+            {
+                auto coalesced = coalescedDriversByTile();
+                nearbyTiles.rebuildIfDue([&](const string &tile)
+                                         { return collectTileCars(tile, coalesced); });
+            }
+            auto now = chrono::steady_clock::now();
+            if (now - lastDeltaMerge >= chrono::milliseconds(DELTA_MERGE_INTERVAL_MS))
+            {
+                lastDeltaMerge = now;
+                locationIndex.mergeDeltas();
+            }
+            if (now - lastRebalance >= chrono::seconds(SHARD_REBALANCE_INTERVAL))
+            {
+                lastRebalance = now;
+                locationIndex.rebalance();
+            }
+            return false;
+        }
+        }
+    }
+
+    static long long elapsedMicros(chrono::steady_clock::time_point start)
+    {
+        return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+    }
+};
+
+// Read-only copy of driver positions and availability, rebuilt by tailing
+// the engine's event log. Serves "cars nearby" queries so map traffic never
+// touches the dispatch engine.
+class FollowerReplica
+{
+private:
+    struct DriverState
+    {
+        double latitude;
+        double longitude;
+        bool available;
+        string geohash; // empty while not indexed
+    };
 
+    // Everything below is guarded by lock: the poller thread applies events
+    // while queries read
+    mutable InstrumentedMutex lock;
+    string path;
+    streamoff offset;
+    string partialLine;
+    unordered_map<int, DriverState> drivers; // changed since the snapshot, if any
+    TrieNode index;                          // available drivers in drivers
+    FrozenSpatialIndex snapshot;
+    uint64_t appliedSequence;
+    uint64_t lastSeenSequence; // latest event read from the log, applied or already in the snapshot
+    uint64_t maxLag;
 
-        // Find nearby drivers using geohash prefix
-        vector<string> nearbyGeohashes = Geohash::getNeighbors(passengerGeohash);
-        nearbyGeohashes.push_back(passengerGeohash);
+    atomic<bool> polling;
+    thread poller;
 
-        priority_queue<DriverMatch, vector<DriverMatch>, greater<DriverMatch>> driverHeap;
+    void apply(const EngineEvent &event)
+    {
+        if (event.sequence <= snapshot.sequence())
+        {
+            return; // already reflected in the snapshot
+        }
+        appliedSequence = event.sequence;
+        if (event.driverId == 0)
+        {
+            return; // ride events without a driver carry no driver state
+        }
+
+        DriverState &state = drivers[event.driverId];
+        if (!state.geohash.empty())
+        {
+            index.removeDriver(state.geohash, event.driverId);
+            state.geohash.clear();
+        }
+        state.latitude = event.latitude;
+        state.longitude = event.longitude;
+        state.available = event.available;
+        if (state.available)
+        {
+            state.geohash = Geohash::encode(state.latitude, state.longitude);
+            index.insertDriver(state.geohash, event.driverId);
+        }
+    }
+
+    // The engine restarted and truncated its log: everything applied so far,
+    // snapshot included, describes the previous run
+    void resync()
+    {
+        cout << "Event log " << path << " restarted; resynchronising from the beginning" << endl;
+        offset = 0;
+        partialLine.clear();
+        drivers.clear();
+        index = TrieNode();
+        snapshot.unload();
+        appliedSequence = 0;
+        lastSeenSequence = 0;
+    }
 
-        for (const auto &geohash : nearbyGeohashes)
+    int pollLocked()
+    {
+        ifstream in(path, ios::binary | ios::ate);
+        if (!in)
+        {
+            return 0;
+        }
+        if ((streamoff)in.tellg() < offset)
         {
-            vector<int> nearbyDriverIds = locationTrie->findDriversWithPrefix(geohash.substr(0, 3));
+            resync();
+        }
+        in.seekg(offset);
 
-            for (int driverId : nearbyDriverIds)
+        string chunk((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        offset += chunk.size();
+        partialLine += chunk;
+
+        int applied = 0;
+        size_t start = 0, end;
+        while ((end = partialLine.find('\n', start)) != string::npos)
+        {
+            EngineEvent event;
+            if (EventLog::parse(partialLine.substr(start, end - start), event))
             {
-                if (drivers.find(driverId) != drivers.end() && drivers[driverId]->available)
+                if (event.sequence <= lastSeenSequence)
                 {
-                    double distance = passenger->location.distanceTo(drivers[driverId]->location);
-                    driverHeap.push(DriverMatch(
-                        driverId,
-                        distance,
-                        drivers[driverId]->lastActive));
+                    // Truncated and rewritten past our offset between polls
+                    resync();
+                    return applied + pollLocked();
                 }
+                lastSeenSequence = event.sequence;
+                apply(event);
+                applied++;
             }
+            start = end + 1;
         }
+        partialLine.erase(0, start);
+        return applied;
+    }
 
-        if (driverHeap.empty())
+    // Sequence of the last complete event the engine has written
+    uint64_t leaderSequence() const
+    {
+        ifstream in(path, ios::binary | ios::ate);
+        if (!in)
         {
-            cout << "No available drivers found for ride request #" << passengerId << endl;
-            return;
+            return 0;
         }
+        streamoff size = in.tellg();
+        streamoff from = max((streamoff)0, size - 512); // events are under 160 bytes
+        in.seekg(from);
+        string tail((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
 
-        // Get the best match (nearest driver)
-        DriverMatch bestMatch = driverHeap.top();
-        int matchedDriverId = bestMatch.driverId;
+        size_t end = tail.rfind('\n');
+        if (end == string::npos)
+        {
+            return 0;
+        }
+        size_t start = tail.rfind('\n', end == 0 ? 0 : end - 1);
+        start = (start == string::npos || start >= end) ? 0 : start + 1;
+        EngineEvent event;
+        return EventLog::parse(tail.substr(start, end - start), event) ? event.sequence : 0;
+    }
 
-        // Assign the driver
-        drivers[matchedDriverId]->setAvailable(false);
-        pendingRequests.erase(passengerId);
+public:
+    FollowerReplica(const string &path)
+        : lock("follower_replica"), path(path), offset(0), appliedSequence(0), lastSeenSequence(0), maxLag(0),
+          polling(false) {}
 
-        cout << "Matched ride request #" << passengerId << " with driver #"
-             << matchedDriverId << " (distance: " << fixed << setprecision(2)
-             << bestMatch.distance << " km)" << endl;
+    FollowerReplica(const FollowerReplica &) = delete;
+    FollowerReplica &operator=(const FollowerReplica &) = delete;
 
-             cout <<  "\n\n " << endl;
+    ~FollowerReplica()
+    {
+        if (polling.exchange(false))
+        {
+            poller.join();
+        }
     }
 
-    void processExpiredRequests()
+    // Applies new events every FOLLOWER_POLL_INTERVAL_MS on a background
+    // thread, so the replica stays current between queries
+    void startPolling()
     {
-        vector<int> expiredIds;
-
-        for (const auto &pair : pendingRequests)
-        {
-            if (pair.second->isExpired())
+        polling.store(true);
+        poller = thread([this]
+                        {
+            while (polling.load())
             {
-                expiredIds.push_back(pair.first);
-            }
-        }
+                poll();
+                this_thread::sleep_for(chrono::milliseconds(FOLLOWER_POLL_INTERVAL_MS));
+            } });
+    }
 
-        for (int id : expiredIds)
+    // Starts from a frozen index snapshot; later events are applied on top
+    bool loadSnapshot(const string &snapshotPath)
+    {
+        lock_guard<InstrumentedMutex> guard(lock);
+        if (!snapshot.load(snapshotPath))
         {
-            cout << "Ride request #" << id << " expired after waiting for "
-                 << pendingRequests[id]->getWaitTime() << endl;
-            pendingRequests.erase(id);
+            cout << "Could not load index snapshot " << snapshotPath << endl;
+            return false;
         }
+        appliedSequence = snapshot.sequence();
+        cout << "Loaded " << snapshot.size() << " drivers from index snapshot (sequence "
+             << snapshot.sequence() << ")" << endl;
+        return true;
     }
 
-    void displayStats()
+    // Applies every complete event appended since the last poll; returns how
+    // many. A log that shrank or restarted its sequence is replayed from the
+    // beginning.
+    int poll()
     {
-        cout << "\n--- System Statistics ---" << endl;
-        cout << "Total Drivers: " << drivers.size() << endl;
+        lock_guard<InstrumentedMutex> guard(lock);
+        return pollLocked();
+    }
 
-        int availableDrivers = 0;
-       
+    // Available drivers within radiusKm, nearest first
+    vector<pair<int, double>> findNearbyDrivers(double latitude, double longitude, double radiusKm)
+    {
+        lock_guard<InstrumentedMutex> guard(lock);
 
-        cout << "\t\t\tAvailable Drivers: "  << endl;
-        cout << "+----+------------------+-------+----------+----------+" << endl;
-        cout << "| ID |       Latitude       |           Longitude     |" << endl;
-        cout << "+----+------------------+-------+----------+----------+" << endl;
-        for (const auto &pair : drivers)
+        // The cell holding the point and its neighbours cover the radius
+        int precision = Geohash::precisionForRadius(latitude, radiusKm);
+        vector<string> cells = precision > 0 ? Geohash::adjacentCells(Geohash::encode(latitude, longitude, precision))
+                                             : vector<string>{""};
+        Location origin(latitude, longitude);
+        vector<pair<int, double>> result;
+
+        for (const auto &cell : cells)
         {
-            if (pair.second->available)
+            // Drivers changed since the snapshot are answered from the trie
+            snapshot.forEachWithPrefix(cell, [&](int driverId, double driverLatitude, double driverLongitude)
+                                       {
+                if (drivers.find(driverId) != drivers.end())
+                {
+                    return;
+                }
+                double distance = origin.distanceTo(Location(driverLatitude, driverLongitude));
+                if (distance <= radiusKm)
+                {
+                    result.push_back({driverId, distance});
+                } });
+
+            for (int driverId : index.findDriversWithPrefix(cell))
             {
-                cout << "| " << (pair.second->id) <<" |       " << pair.second->location.latitude << "       |           " << pair.second->location.longitude <<"     |" << endl;
-                // cout <<  << " -> " << (pair.second->location.latitude)  << " :: "<< pair.second->location.longitude << endl;
-                availableDrivers++;
+                const DriverState &state = drivers[driverId];
+                double distance = origin.distanceTo(Location(state.latitude, state.longitude));
+                if (distance <= radiusKm)
+                {
+                    result.push_back({driverId, distance});
+                }
             }
         }
-        cout << "+----+------------------+-------+----------+----------+" << endl;
-        cout << "Total Available Drivers : " << availableDrivers << endl;
-        cout << "Pending Ride Requests: " << pendingRequests.size() << endl;
 
-        if (!pendingRequests.empty())
+        sort(result.begin(), result.end(), [](const pair<int, double> &a, const pair<int, double> &b)
+             { return a.second < b.second; });
+        return result;
+    }
+
+    // Lag is counted in events the engine has written but this replica has
+    // not applied yet
+    void displayLag()
+    {
+        lock_guard<InstrumentedMutex> guard(lock);
+        uint64_t current = max(appliedSequence, lastSeenSequence);
+        uint64_t leader = max(leaderSequence(), current);
+        uint64_t lag = leader - current;
+        maxLag = max(maxLag, lag);
+        cout << "Applied sequence: " << appliedSequence << ", leader sequence: " << leader << endl;
+        cout << "Replication lag: " << lag << " events (max " << maxLag << ")" << endl;
+    }
+};
+
+// Serves nearby-car queries from a follower of the given event log,
+// optionally starting from a frozen index snapshot
+void followerMenu(const string &eventLogPath, const string &snapshotPath = "")
+{
+    FollowerReplica replica(eventLogPath);
+    if (!snapshotPath.empty())
+    {
+        replica.loadSnapshot(snapshotPath);
+    }
+    replica.startPolling();
+    double lat = 0, lng = 0, radius = 0;
+
+    while (true)
+    {
+        cout << "Enter latitude, longitude and radius in km (radius 0 to exit): ";
+        if (!(cin >> lat >> lng >> radius) || radius <= 0)
         {
-            cout << "\nPending Requests:" << endl;
-            for (const auto &pair : pendingRequests)
-            {
-                cout << "  Request #" << pair.first << " - Waiting for "
-                     << pair.second->getWaitTime() << endl;
-            }
+            break;
         }
 
-        cout << "-------------------------------------------------------\n"
-             << endl;
-             cout << "\n\n " << endl;
+        auto nearby = replica.findNearbyDrivers(lat, lng, radius);
+        cout << nearby.size() << " cars nearby" << endl;
+        for (const auto &car : nearby)
+        {
+            cout << "  Driver #" << car.first << " (" << fixed << setprecision(2) << car.second << " km)" << endl;
+        }
+        replica.displayLag();
     }
-};
+}
 
 // Interactive menu
 void userMenu(RideSharingSystem &riderSharingSystem)
@@ -583,6 +6210,7 @@ void userMenu(RideSharingSystem &riderSharingSystem)
     {
         cout << "|--------------------------------------------------------------------------------|" << endl;
         cout << "|                             1. Request a ride                                  |" << endl;
+        cout << "|                             2. Show cars near me                               |" << endl;
         cout << "|                             0. Exit                                            |" << endl;
         cout << "|--------------------------------------------------------------------------------|" << endl;
 
@@ -599,7 +6227,28 @@ void userMenu(RideSharingSystem &riderSharingSystem)
             cin >> lat;
             cout << "Enter passenger longitude: ";
             cin >> lng;
-            riderSharingSystem.requestRide(lat, lng);
+            // Clients resending after a timeout reuse the key of the first attempt
+            string key;
+            cout << "Enter request key (- for none): ";
+            cin >> key;
+            riderSharingSystem.submitRideRequest(lat, lng, key == "-" ? "" : key);
+            break;
+        }
+        case 2:
+        {
+            double lat, lng;
+            cout << "Enter your latitude: ";
+            cin >> lat;
+            cout << "Enter your longitude: ";
+            cin >> lng;
+            for (const auto &tile : riderSharingSystem.getNearbyCarTiles(lat, lng))
+            {
+                for (const auto &car : NearbyTileCache::decodeTile(tile.first, tile.second))
+                {
+                    cout << "  Car #" << get<0>(car) << " at (" << fixed << setprecision(5)
+                         << get<1>(car) << ", " << get<2>(car) << ")" << endl;
+                }
+            }
             break;
         }
 
@@ -609,6 +6258,9 @@ void userMenu(RideSharingSystem &riderSharingSystem)
         default:
             cout << "Invalid choice. Please try again." << endl;
         }
+
+        // Queued requests and location pings are dispatched between commands
+        riderSharingSystem.runTick();
     } while (choice != 0);
 }
 
@@ -628,6 +6280,16 @@ void adminMenu(RideSharingSystem &riderSharingSystem)
         cout << "|                     3. Set driver availability                                 |" << endl;
         cout << "|                     4. Process expired requests                                |" << endl;
         cout << "|                     5. Display system statistics                               |" << endl;
+        cout << "|                     6. Display admission control state                         |" << endl;
+        cout << "|                     7. Display shard load                                      |" << endl;
+        cout << "|                     8. Recompute shard layout                                  |" << endl;
+        cout << "|                     9. Complete a trip                                         |" << endl;
+        cout << "|                     10. Dump slow match requests                               |" << endl;
+        cout << "|                     11. Compare dispatch policies (what-if)                    |" << endl;
+        cout << "|                     12. Display shadow matcher report                          |" << endl;
+        cout << "|                     13. Query fleet                                            |" << endl;
+        cout << "|                     14. Save index snapshot                                    |" << endl;
+        cout << "|                     15. Update trip progress                                   |" << endl;
         cout << "|                     0. Exit                                                    |" << endl;
         cout << "|--------------------------------------------------------------------------------|" << endl;
 
@@ -639,11 +6301,18 @@ void adminMenu(RideSharingSystem &riderSharingSystem)
         case 1:
         {
             double lat, lng;
+            int vehicleClass;
             cout << "Enter latitude: ";
             cin >> lat;
             cout << "Enter longitude: ";
             cin >> lng;
-            riderSharingSystem.addDriver(lat, lng);
+            cout << "Vehicle class (0 = standard, 1 = EV, 2 = XL): ";
+            cin >> vehicleClass;
+            if (vehicleClass < 0 || vehicleClass >= VEHICLE_CLASS_COUNT)
+            {
+                vehicleClass = VEHICLE_STANDARD;
+            }
+            riderSharingSystem.addDriver(lat, lng, (VehicleClass)vehicleClass);
             break;
         }
         case 2:
@@ -656,7 +6325,7 @@ void adminMenu(RideSharingSystem &riderSharingSystem)
             cin >> lat;
             cout << "Enter new longitude: ";
             cin >> lng;
-            riderSharingSystem.updateDriverLocation(id, lat, lng);
+            riderSharingSystem.submitLocationUpdate(id, lat, lng);
             break;
         }
         case 3:
@@ -677,6 +6346,76 @@ void adminMenu(RideSharingSystem &riderSharingSystem)
         case 5:
             riderSharingSystem.displayStats();
             break;
+        case 6:
+            riderSharingSystem.displayAdmissionState();
+            break;
+        case 7:
+            riderSharingSystem.displayShardLoad();
+            break;
+        case 8:
+            riderSharingSystem.computeShardLayout();
+            break;
+        case 9:
+        {
+            int id;
+            cout << "Enter driver ID: ";
+            cin >> id;
+            riderSharingSystem.completeTrip(id);
+            break;
+        }
+        case 10:
+            riderSharingSystem.dumpSlowMatches();
+            break;
+        case 11:
+            riderSharingSystem.compareDispatchPolicies();
+            break;
+        case 12:
+            riderSharingSystem.displayShadowReport();
+            break;
+        case 13:
+        {
+            FleetQuery query;
+            long long idleMinutes;
+            cout << "Zone geohash prefix (* for everywhere): ";
+            cin >> query.zone;
+            if (query.zone == "*")
+            {
+                query.zone.clear();
+            }
+            cout << "Vehicle class (-1 = any, 0 = standard, 1 = EV, 2 = XL): ";
+            cin >> query.vehicleClass;
+            cout << "Status (-1 = any, 1 = available, 0 = unavailable): ";
+            cin >> query.available;
+            cout << "Idle for at least (minutes): ";
+            cin >> idleMinutes;
+            query.minIdleSeconds = idleMinutes * 60;
+            riderSharingSystem.displayFleetQuery(query);
+            break;
+        }
+        case 14:
+        {
+            string path;
+            cout << "Snapshot file: ";
+            cin >> path;
+            riderSharingSystem.saveIndexSnapshot(path);
+            break;
+        }
+        case 15:
+        {
+            int id;
+            double lat, lng;
+            long long seconds;
+            cout << "Enter driver ID: ";
+            cin >> id;
+            cout << "Enter dropoff latitude: ";
+            cin >> lat;
+            cout << "Enter dropoff longitude: ";
+            cin >> lng;
+            cout << "Seconds to dropoff: ";
+            cin >> seconds;
+            riderSharingSystem.updateTripProgress(id, lat, lng, seconds);
+            break;
+        }
 
         case 0:
             cout << "Exiting..." << endl;
@@ -684,13 +6423,59 @@ void adminMenu(RideSharingSystem &riderSharingSystem)
         default:
             cout << "Invalid choice. Please try again." << endl;
         }
+
+        // Queued requests and location pings are dispatched between commands
+        riderSharingSystem.runTick();
     } while (choice != 0);
 }
-int main()
+int main(int argc, char *argv[])
 {
+    // --follow <path> [--snapshot <file>] runs a read-only replica of an
+    // engine's event log
+    if (argc >= 3 && string(argv[1]) == "--follow")
+    {
+        bool withSnapshot = argc >= 5 && string(argv[3]) == "--snapshot";
+        followerMenu(argv[2], withSnapshot ? argv[4] : "");
+        return 0;
+    }
+
     system("cls");
     int choice;
     RideSharingSystem riderSharingSystem;
+
+    // Stands in for the passenger app: shows where each tracked driver is now
+    riderSharingSystem.setTripUpdateSink([](int passengerId, int driverId, const TrackingSample *samples, size_t count)
+                                         {
+        const TrackingSample &latest = samples[count - 1];
+        cout << "Ride request #" << passengerId << ": driver #" << driverId << " at ("
+             << latest.latitude << ", " << latest.longitude << "), " << count << " new positions" << endl; });
+
+    for (int i = 1; i < argc; i++)
+    {
+        string option = argv[i];
+        if (option == "--event-log" && i + 1 < argc)
+        {
+            // Lets followers tail this engine
+            riderSharingSystem.attachEventLog(argv[++i]);
+        }
+        else if (option == "--shm")
+        {
+            // Shares the driver table with co-located services
+            riderSharingSystem.publishToSharedMemory();
+        }
+        else if (option == "--export-dir" && i + 1 < argc)
+        {
+            riderSharingSystem.startEventExport(argv[++i]);
+        }
+        else if (option == "--shadow")
+        {
+            riderSharingSystem.startShadowMatcher();
+        }
+        else if (option == "--metrics-port" && i + 1 < argc)
+        {
+            riderSharingSystem.startMetricsServer(atoi(argv[++i]));
+        }
+    }
     do
     {
         cout << "|--------------------------------------------------------------------------------|" << endl;